@@ -69,6 +69,7 @@ struct usbtmc_termchar {
 #define USBTMC_FLAG_ASYNC		0x0001
 #define USBTMC_FLAG_APPEND		0x0002
 #define USBTMC_FLAG_IGNORE_TRAILER	0x0004
+#define USBTMC_FLAG_STREAM		0x0008
 
 struct usbtmc_message {
 	__u32 transfer_size; /* size of bytes to transfer */
@@ -77,6 +78,88 @@ struct usbtmc_message {
 	void __user *message; /* pointer to header and data in user space */
 } __attribute__ ((packed));
 
+/*
+ * Message with 64 bit sizes for USBTMC_IOCTL_READ_MSG64/WRITE_MSG64.
+ * The driver adds and removes the USBTMC headers like read()/write().
+ */
+struct usbtmc_message64 {
+	__u64 transfer_size; /* size of bytes to transfer */
+	__u64 transferred; /* size of received/written bytes */
+	__u64 message; /* pointer to data in user space */
+} __attribute__ ((packed));
+
+/*
+ * Command and response buffers for USBTMC_IOCTL_QUERY. The command is
+ * sent with EOM as configured by USBTMC_IOCTL_EOM_ENABLE.
+ */
+struct usbtmc_query {
+	__u32 command_size; /* size of the command */
+	__u32 response_size; /* size of the response buffer */
+	__u32 transferred; /* size of the received response */
+	__u32 reserved;
+	__u64 command; /* pointer to the command in user space */
+	__u64 response; /* pointer to the response buffer in user space */
+} __attribute__ ((packed));
+
+/*
+ * Zero copy receive ring, see USBTMC_IOCTL_RING_SETUP
+ * usbtmc_ring_desc->flags:
+ */
+#define USBTMC_RING_FLAG_EOM		0x0001
+
+struct usbtmc_ring_setup {
+	__u32 nr_slots; /* number of receive buffers, 0 frees the ring */
+	__u32 slot_size; /* returned: distance between buffers in the mmap */
+} __attribute__ ((packed));
+
+struct usbtmc_ring_desc {
+	__u32 slot; /* index of the buffer, to be handed back with RING_RELEASE */
+	__u32 offset; /* offset of the buffer in the mmap'd area */
+	__u32 length; /* number of bytes received in the buffer */
+	__u32 flags; /* USBTMC_RING_FLAG_EOM: last buffer of the transfer */
+} __attribute__ ((packed));
+
+/*
+ * usbtmc_queue_depth->flags:
+ */
+#define USBTMC_QUEUE_DEPTH_ADAPTIVE	0x0001
+
+struct usbtmc_queue_depth {
+	__u32 in_urbs; /* max bulk in urbs in flight, 0 = device default */
+	__u32 out_urbs; /* max bulk out urbs in flight, 0 = device default */
+	__u32 flags; /* bit 0: adapt depths to the observed completions */
+} __attribute__ ((packed));
+
+/*
+ * Bulk urb buffer sizes in bytes, rounded to whole packets.
+ * A size of 0 keeps the current size.
+ */
+struct usbtmc_bufsize {
+	__u32 in_size; /* size of the bulk in urb buffers */
+	__u32 out_size; /* size of the bulk out urb buffers */
+} __attribute__ ((packed));
+
+/*
+ * Bulk in urbs chosen from the sizes of the last responses
+ * usbtmc_read_profile->flags:
+ */
+#define USBTMC_READ_PROFILE_ADAPTIVE	0x0001
+
+struct usbtmc_read_profile {
+	__u32 history[8]; /* N_characters of the last responses, oldest first */
+	__u32 nr_history; /* number of valid history entries */
+	__u32 first_urb_size; /* size of the first bulk in urb of the next read */
+	__u32 first_urbs; /* urbs posted before the response header arrives */
+	__u32 flags; /* bit 0: plan the urbs from the history */
+} __attribute__ ((packed));
+
+/*
+ * Priority of a file handle in the transaction queue of the device.
+ * High priority handles take their turn before normal ones.
+ */
+#define USBTMC_PRIORITY_NORMAL		0
+#define USBTMC_PRIORITY_HIGH		1
+
 /* Request values for USBTMC driver's ioctl entry point */
 #define USBTMC_IOC_NR			91
 #define USBTMC_IOCTL_INDICATOR_PULSE	_IO(USBTMC_IOC_NR, 1)
@@ -113,6 +196,27 @@ struct usbtmc_message {
 #define USBTMC_IOCTL_CANCEL_IO		_IO(USBTMC_IOC_NR, 35)
 #define USBTMC_IOCTL_CLEANUP_IO		_IO(USBTMC_IOC_NR, 36)
 
+/* Zero copy receive ring */
+#define USBTMC_IOCTL_RING_SETUP		_IOWR(USBTMC_IOC_NR, 37, struct usbtmc_ring_setup)
+#define USBTMC_IOCTL_RING_READ		_IOR(USBTMC_IOC_NR, 38, struct usbtmc_ring_desc)
+#define USBTMC_IOCTL_RING_RELEASE	_IOW(USBTMC_IOC_NR, 39, __u32)
+
+#define USBTMC_IOCTL_GET_QUEUE_DEPTH	_IOR(USBTMC_IOC_NR, 40, struct usbtmc_queue_depth)
+#define USBTMC_IOCTL_SET_QUEUE_DEPTH	_IOW(USBTMC_IOC_NR, 41, struct usbtmc_queue_depth)
+
+/* Read an IEEE 488.2 definite length block, returns only the block data */
+#define USBTMC_IOCTL_READ_BLOCK		_IOWR(USBTMC_IOC_NR, 42, struct usbtmc_message)
+#define USBTMC_IOCTL_READ_MSG64		_IOWR(USBTMC_IOC_NR, 43, struct usbtmc_message64)
+#define USBTMC_IOCTL_WRITE_MSG64	_IOWR(USBTMC_IOC_NR, 44, struct usbtmc_message64)
+#define USBTMC_IOCTL_QUERY		_IOWR(USBTMC_IOC_NR, 45, struct usbtmc_query)
+
+#define USBTMC_IOCTL_GET_BUFSIZE	_IOR(USBTMC_IOC_NR, 46, struct usbtmc_bufsize)
+#define USBTMC_IOCTL_SET_BUFSIZE	_IOWR(USBTMC_IOC_NR, 47, struct usbtmc_bufsize)
+#define USBTMC_IOCTL_GET_READ_PROFILE	_IOR(USBTMC_IOC_NR, 48, struct usbtmc_read_profile)
+#define USBTMC_IOCTL_SET_READ_PROFILE	_IOW(USBTMC_IOC_NR, 49, struct usbtmc_read_profile)
+#define USBTMC_IOCTL_GET_PRIORITY	_IOR(USBTMC_IOC_NR, 50, __u8)
+#define USBTMC_IOCTL_SET_PRIORITY	_IOW(USBTMC_IOC_NR, 51, __u8)
+
 /* Driver encoded usb488 capabilities */
 #define USBTMC488_CAPABILITY_TRIGGER         1
 #define USBTMC488_CAPABILITY_SIMPLE          2
@@ -13,6 +13,8 @@
 
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
@@ -413,6 +415,101 @@ static int testSRQ() {
 	return 1;
 }
 
+/* Compare write() + read() with USBTMC_IOCTL_QUERY for 100 *IDN? queries */
+static int testQuery() {
+	struct usbtmc_query query;
+	char cmd[] = "*IDN?\n";
+	int i;
+
+	printf("\nTesting query latency\n");
+	getTS();
+	for (i=0;i<100;i++) {
+		sscope(cmd);
+		if (0 == rscope((char *)buf,MAX_BL)) {
+			printf("write/read query failed\n");
+			return 0;
+		}
+	}
+	printf("100 queries with write/read: %11.6f\n" ,getTS());
+
+	memset(&query,0,sizeof(query));
+	query.command = (__u64)(unsigned long)cmd;
+	query.command_size = strlen(cmd);
+	query.response = (__u64)(unsigned long)buf;
+	query.response_size = MAX_BL-1; /* room for the terminating 0 */
+	for (i=0;i<100;i++) {
+		if (0 != ioctl(fd,USBTMC_IOCTL_QUERY,&query)) {
+			perror("query ioctl failed");
+			return 0;
+		}
+	}
+	printf("100 queries with USBTMC_IOCTL_QUERY: %11.6f\n" ,getTS());
+	buf[query.transferred] = 0;
+	printf("Last response: %s",buf);
+	return 1;
+}
+
+/*
+ * Measure epoll_wait() on this handle while a child process keeps the
+ * instrument busy with waveform reads on a second handle.
+ */
+static int testPoll() {
+	struct epoll_event ev;
+	double t, tmin = 1e9, tmax = 0, tsum = 0;
+	int epfd, fd2, i, n;
+	pid_t pid;
+
+	printf("\nTesting epoll_wait latency with a busy device\n");
+	epfd = epoll_create1(0);
+	if (epfd < 0) {
+		perror("epoll_create1 failed");
+		return 0;
+	}
+	ev.events = EPOLLIN | EPOLLPRI | EPOLLET;
+	ev.data.fd = fd;
+	if (0 != epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		perror("epoll_ctl failed");
+		close(epfd);
+		return 0;
+	}
+
+	pid = fork();
+	if (pid == 0) {
+		static char wbuf[1024*1024];
+		if (0 > (fd2 = open("/dev/usbtmc0",O_RDWR)))
+			exit(1);
+		strcpy(wbuf,":WAV:POIN:MODE MAX;:WAV:FORM BYTE\n");
+		write(fd2,wbuf,strlen(wbuf));
+		for (i=0;i<20;i++) {
+			write(fd2,":WAV:DATA?\n",11);
+			while (sizeof(wbuf) == read(fd2,wbuf,sizeof(wbuf)))
+				;
+		}
+		close(fd2);
+		exit(0);
+	}
+
+	usleep(100000); /* let the child start its transfers */
+	for (i=0;i<1000;i++) {
+		getTS();
+		n = epoll_wait(epfd, &ev, 1, 0);
+		t = getTS();
+		if (n < 0) {
+			perror("epoll_wait failed");
+			break;
+		}
+		tsum += t;
+		if (t < tmin) tmin = t;
+		if (t > tmax) tmax = t;
+		usleep(1000);
+	}
+	waitpid(pid, NULL, 0);
+	close(epfd);
+	printf("epoll_wait over %d calls: min %9.6f avg %9.6f max %9.6f\n",
+	       i, tmin, tsum / (i ? i : 1), tmax);
+	return 1;
+}
+
 int main () {
   int rv;
   unsigned int tmp,tmp1,ren,timeout;
@@ -507,7 +604,7 @@ int main () {
   sscope(":AUTOSCALE\n");
 
   while (1) {
-    printf("Enter command: [I]nteractive,  [T]est, [S]tb, s[R]q, [Q]uit:");
+    printf("Enter command: [I]nteractive,  [T]est, [S]tb, s[R]q, [L]atency, [P]oll, [Q]uit:");
     fflush(stdout);
 
     len = read(0,buf,MAX_BL);
@@ -598,6 +695,16 @@ int main () {
 	    testSRQ();
 	    break;
 
+    case 'L':
+    case 'l':
+	    testQuery();
+	    break;
+
+    case 'P':
+    case 'p':
+	    testPoll();
+	    break;
+
     case 'S':
     case 's':
 	    testSTB();
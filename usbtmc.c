@@ -22,6 +22,15 @@
 #include <linux/mutex.h>
 #include <linux/usb.h>
 #include <linux/compat.h>
+#include <linux/mm.h>
+#include <linux/ktime.h>
+#include <linux/uio.h>
+#include <linux/workqueue.h>
+#include <linux/sched/mm.h>
+#include <linux/kthread.h>
+#include <linux/mempool.h>
+#include <linux/shrinker.h>
+#include <linux/version.h>
 #include "tmc.h"
 
 /* Workaround for Linux kernel < 5.4 'fallthrough'*/
@@ -38,7 +47,7 @@
  * or when changing a significant behavior of the driver.
  */
 #define USBTMC_VERSION         "1.6"
-#define USBTMC_API_VERSION      (3)
+#define USBTMC_API_VERSION      (12)
 #define USBTMC_HEADER_SIZE	12
 #define USBTMC_MINOR_BASE	176
 
@@ -47,10 +56,41 @@
 /* Default USB timeout (in milliseconds) */
 #define USBTMC_TIMEOUT		5000
 
-/* Max number of urbs used in write transfers */
+/* Default max number of urbs in flight per direction */
 #define MAX_URBS_IN_FLIGHT	16
+/* Limits for the tunable queue depth */
+#define USBTMC_MIN_QUEUE_DEPTH	2
+#define USBTMC_MAX_QUEUE_DEPTH	256
+/* Number of transfers without running dry before the depth is reduced */
+#define USBTMC_ADAPT_SHRINK_AFTER	8
 /* I/O buffer size used in generic read/write functions */
 #define USBTMC_BUFSIZE		(4096)
+/* Upper limit of the bulk buffer sizes, physically contiguous buffers */
+#define USBTMC_MAX_BUFSIZE	min_t(u32, 4 * 1024 * 1024, KMALLOC_MAX_SIZE)
+/* Larger bulk buffers are allocated with kzalloc() instead of the pool */
+#define USBTMC_POOL_MAX_OBJ	(64 * 1024)
+/* Default SuperSpeed bulk buffer in bursts of maxp * (bMaxBurst + 1) */
+#define USBTMC_SS_BURSTS	4
+/* Bytes in flight per direction the SuperSpeed queue depth aims for */
+#define USBTMC_SS_IN_FLIGHT	(1024 * 1024)
+/* Bulk buffers kept in reserve for allocations that must not sleep */
+#define USBTMC_POOL_RESERVE	4
+/* Size of the scatter-gather bulk in urbs for large reads */
+#define USBTMC_SG_URB_SIZE	(1024 * 1024)
+/* Generic writes of at least this size are sent from pinned user pages */
+#define USBTMC_ZC_WRITE_MIN	(64 * 1024)
+/* Max number of pages per zero copy bulk out urb */
+#define USBTMC_ZC_URB_PAGES	64
+/* Size of one DEV_DEP_MSG transfer in the 64 bit message ioctls */
+#define USBTMC_MSG_CHUNK	(1U << 30)
+/* Room for an IEEE 488.2 block header and trailer in block reads */
+#define USBTMC_BLOCK_SLACK	64
+/* Max number of buffers in the zero copy receive ring */
+#define USBTMC_MAX_RING_SLOTS	256
+/* Number of response sizes kept to plan the bulk in urbs of a read */
+#define USBTMC_IN_HIST		8
+/* Default bound of the reservation for a response, 0: the IO timeout */
+#define USBTMC_TXN_HOLD_MS	0
 
 /*
  * Maximum number of read cycles to empty bulk in endpoint during CLEAR and
@@ -70,6 +110,14 @@ static unsigned int usb_timeout = USBTMC_TIMEOUT;
 module_param(usb_timeout, uint,  S_IRUGO | S_IWUSR);
 MODULE_PARM_DESC(usb_timeout, "USB timeout in milliseconds");
 
+static bool coherent_buffers;
+module_param(coherent_buffers, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(coherent_buffers, "Allocate bulk IO buffers from coherent DMA memory");
+
+/* bulk urb buffers of io_buffer_size at load time, see usbtmc_init() */
+static struct kmem_cache *usbtmc_buf_cache;
+static unsigned int usbtmc_buf_cache_size;
+
 static const struct usb_device_id usbtmc_devices[] = {
 	{ USB_INTERFACE_INFO(USB_CLASS_APP_SPEC, 3, 0), },
 	{ USB_INTERFACE_INFO(USB_CLASS_APP_SPEC, 3, 1), },
@@ -97,7 +145,7 @@ struct usbtmc_device_data {
 	const struct usb_device_id *id;
 	struct usb_device *usb_dev;
 	struct usb_interface *intf;
-	struct list_head file_list;
+	struct list_head file_list; /* RCU, written under dev_lock */
 
 	unsigned int bulk_in;
 	unsigned int bulk_out;
@@ -107,10 +155,14 @@ struct usbtmc_device_data {
 	u8 bTag_last_read;	/* needed for abort */
 
 	/* packet size of IN bulk ep */
-	u16            bin_bsiz;
+	u32            bin_bsiz;
 
 	/* packet size of OUT bulk ep */
-	u16            bout_bsiz;
+	u32            bout_bsiz;
+
+	/* wMaxPacketSize of the bulk endpoints */
+	u16            bin_maxp;
+	u16            bout_maxp;
 
 	/* data for interrupt in endpoint handling */
 	u8             bNotify1;
@@ -125,6 +177,30 @@ struct usbtmc_device_data {
 	struct urb    *iin_urb;
 	u16            iin_wMaxPacketSize;
 
+	/* default queue depths for new file handles (sysfs) */
+	u32            in_queue_depth;
+	u32            out_queue_depth;
+
+	/* bulk urb buffers from usb_alloc_coherent() */
+	bool           coherent_buffers;
+
+	/* urb buffer memory of all file handles, limit 0 = unlimited (sysfs) */
+	atomic_long_t     urb_mem;
+	unsigned long     urb_mem_limit;
+	/* bulk in urbs reused from and created past the stashes (sysfs) */
+	atomic_long_t     in_stash_hits;
+	atomic_long_t     in_stash_misses;
+	unsigned int      nr_handles;
+
+	/* bulk urb buffers shared by all file handles and both directions */
+	mempool_t         *buf_pool;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	struct shrinker   *shrinker;	/* frees idle stashed urbs */
+#else
+	struct shrinker    shrinker;
+	bool               shrinker_registered;
+#endif
+
 	/* coalesced usb488_caps from usbtmc_dev_capabilities */
 	__u8 usb488_caps;
 
@@ -133,9 +209,19 @@ struct usbtmc_device_data {
 	struct usbtmc_dev_capabilities	capabilities;
 	struct kref kref;
 	struct mutex io_mutex;	/* only one i/o function running at a time */
+	struct mutex ctrl_mutex; /* control pipe requests, iin_bTag, taken after io_mutex */
 	wait_queue_head_t waitq;
 	struct fasync_struct *fasync;
-	spinlock_t dev_lock; /* lock for file_list */
+	spinlock_t dev_lock; /* file_list writers and the transaction queue */
+	struct workqueue_struct *aio_wq; /* ordered, runs async iocbs */
+
+	/* bulk transaction queue, see usbtmc_txn_begin() */
+	struct list_head txn_queue;
+	wait_queue_head_t txn_wait;
+	bool txn_busy;
+	struct usbtmc_file_data *txn_owner; /* writer with a response pending */
+	unsigned long txn_expires;
+	unsigned int txn_hold_ms; /* sysfs */
 };
 #define to_usbtmc_data(d) container_of(d, struct usbtmc_device_data, kref)
 
@@ -145,12 +231,48 @@ struct usbtmc_list {
 	spinlock_t lock;
 };
 
+/* Queue depth of one bulk direction, see usbtmc_adapt_depth() */
+struct usbtmc_depth {
+	u32 max;	/* max number of urbs in flight */
+	bool refilled;	/* transfer needed more urbs than max */
+	bool starved;	/* endpoint ran out of posted urbs during transfer */
+	u32 calm;	/* refilled transfers in a row that never starved */
+};
+
+enum usbtmc_slot_state {
+	USBTMC_SLOT_FREE,	/* available for the next transfer */
+	USBTMC_SLOT_POSTED,	/* urb submitted or completed on ring->done */
+	USBTMC_SLOT_USER,	/* returned by RING_READ, owned by user space */
+};
+
+/* One buffer of the zero copy receive ring */
+struct usbtmc_ring_slot {
+	struct usbtmc_file_data *file_data;
+	struct urb *urb;
+	struct page *pages;
+	u32 index;
+	enum usbtmc_slot_state state;
+};
+
+struct usbtmc_ring {
+	struct usbtmc_ring_slot *slots;
+	u32 nr_slots;
+	u32 slot_size;		/* page aligned distance between buffers */
+	u32 urb_size;		/* bin_bsiz when the ring was set up */
+	unsigned int order;
+	u32 posted;		/* slots in flight or on done */
+	bool active;		/* transfer running, released slots are reposted */
+	atomic_t mmap_count;
+	struct usb_anchor done;	/* completed urbs in order of completion */
+};
+
 /*
  * This structure holds private data for each USBTMC file handle.
  */
 struct usbtmc_file_data {
 	struct usbtmc_device_data *data;
 	struct list_head file_elem;
+	struct rcu_head rcu;	/* freed after the readers of file_list */
 
 	u32            timeout;
 	u8             srq_byte;
@@ -162,11 +284,29 @@ struct usbtmc_file_data {
 	u8             term_char;
 	bool           term_char_enabled;
 	bool           auto_abort;
+	bool           out_msg_open;	/* last message written without EOM */
+	u8             priority;	/* USBTMC_PRIORITY_*, see usbtmc_txn_begin() */
+
+	struct usbtmc_depth in_depth;
+	struct usbtmc_depth out_depth;
+	bool           adaptive_depth;
+
+	/* bulk urb buffer sizes, see usbtmc_set_bsiz() */
+	u32            bin_bsiz;
+	u32            bout_bsiz;
+
+	/* response size history, see usbtmc_plan_in_urbs() */
+	bool           adaptive_in;
+	u32            in_hist[USBTMC_IN_HIST];
+	u32            in_hist_len;
+	u32            in_hist_pos;
 
 	spinlock_t     err_lock; /* lock for errors */
 
 	struct usb_anchor submitted_in;
 	struct usb_anchor submitted_out;
+	struct usb_anchor submitted_zc;	/* zero copy bulk out urbs */
+	atomic_t zc_out_in_flight;
 
 	/* data for generic_write */
 	u32 out_transfer_size;
@@ -180,17 +320,49 @@ struct usbtmc_file_data {
 	struct usb_anchor in_anchor;
 	struct usbtmc_list stashed_urbs;
 	wait_queue_head_t wait_bulk_in;
+	wait_queue_head_t poll_wait;	/* readiness changes, see usbtmc_poll() */
+
+	/* urb buffer memory owned by this handle, see usbtmc_charge() */
+	long urb_mem;
+
+	/* recycled bulk in urbs */
+	struct usbtmc_list stashed_in_urbs;
+	int in_urbs_stashed;
+	/* recycled scatter-gather bulk in urbs, used while in_sg is set */
+	struct usbtmc_list stashed_sg_urbs;
+	int sg_urbs_stashed;
+	bool in_sg;
+
+	/* zero copy receive ring */
+	struct usbtmc_ring *ring;
+
+	/* read-ahead streaming state (USBTMC_FLAG_STREAM) */
+	bool in_streaming;
+	bool in_stream_eom;	/* short packet received */
+	struct urb *in_partial;	/* completed urb with unread data */
+	u32 in_partial_offset;
 };
 
 /* Forward declarations */
 static struct usb_driver usbtmc_driver;
 static void usbtmc_draw_down(struct usbtmc_file_data *file_data);
 static void usbtmc_release_out_urbs(struct usbtmc_file_data *file_data);
+static void usbtmc_recover_in_urbs(struct usbtmc_file_data *file_data);
+static void usbtmc_release_in_urbs(struct usbtmc_file_data *file_data);
+static void usbtmc_ring_stop(struct usbtmc_file_data *file_data);
+static void usbtmc_ring_free(struct usbtmc_file_data *file_data);
+static void usbtmc_stream_stop(struct usbtmc_file_data *file_data);
+static void usbtmc_free_buf_pool(struct usbtmc_device_data *data);
+static void usbtmc_destroy_sg_urb(struct usbtmc_file_data *file_data,
+				  struct urb *urb);
 
 static void usbtmc_delete(struct kref *kref)
 {
 	struct usbtmc_device_data *data = to_usbtmc_data(kref);
 
+	if (data->aio_wq)
+		destroy_workqueue(data->aio_wq);
+	usbtmc_free_buf_pool(data);
 	usb_put_dev(data->usb_dev);
 	kfree(data);
 }
@@ -201,6 +373,203 @@ static void usbtmc_init_list(struct usbtmc_list *list) {
 	spin_lock_init(&list->lock);
 }
 
+/*
+ * Wakes the pollers of one file handle. The key lets epoll skip
+ * EPOLLEXCLUSIVE waiters that are not interested in the change.
+ */
+static void usbtmc_wake_poll(struct usbtmc_file_data *file_data, __poll_t mask)
+{
+	wake_up_interruptible_poll(&file_data->poll_wait, mask);
+}
+
+/*
+ * Bulk transaction queue
+ *
+ * File handles get the bulk endpoints in FIFO order. A handle that wrote
+ * a message keeps the device until it has read the response, its IO
+ * timeout (bounded by txn_hold_ms) has passed or it is closed, so the
+ * response is not consumed by the read of another handle. The same
+ * holds for an incomplete message or response. Its reads go ahead of
+ * the queue, a new write of the owner gives up the reservation and
+ * queues up.
+ *
+ * Bulk in urbs that stay posted between calls (read-ahead stream, zero
+ * copy ring, asynchronous raw read) would receive the data of another
+ * handle. Their owner keeps the device without time limit, other
+ * handles get -EBUSY once the reservation has expired.
+ *
+ * High priority handles are queued before normal ones. They only get
+ * their turn between complete transactions: the device has a single
+ * output queue, so a reservation holds back all priorities.
+ */
+struct usbtmc_txn_waiter {
+	struct list_head list;
+	struct usbtmc_file_data *file_data;
+	u8 priority;
+};
+
+/* Bulk in urbs of the handle stay posted after the call returns */
+static bool usbtmc_in_posted(struct usbtmc_file_data *file_data)
+{
+	struct usbtmc_ring *ring = READ_ONCE(file_data->ring);
+
+	return READ_ONCE(file_data->in_streaming) ||
+		READ_ONCE(file_data->in_urbs_used) ||
+		(ring && READ_ONCE(ring->active));
+}
+
+static bool usbtmc_txn_ready(struct usbtmc_device_data *data,
+			     struct usbtmc_txn_waiter *w, bool cont)
+{
+	/* dev_lock held */
+	if (data->zombie)
+		return true;
+	if (data->txn_busy)
+		return false;
+	if (cont && data->txn_owner == w->file_data)
+		return true;
+	if (data->txn_owner && (time_before(jiffies, data->txn_expires) ||
+				usbtmc_in_posted(data->txn_owner)))
+		return false;
+	return list_first_entry(&data->txn_queue,
+				struct usbtmc_txn_waiter, list) == w;
+}
+
+/*
+ * Waits for the turn of the file handle. cont is set for operations
+ * that continue the transaction of the owner (reads, clear, abort).
+ */
+static int usbtmc_txn_begin(struct usbtmc_file_data *file_data, bool cont)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_txn_waiter w = { .file_data = file_data };
+	struct usbtmc_txn_waiter *pos;
+	long tmo;
+	int rv = 0;
+
+	w.priority = READ_ONCE(file_data->priority);
+
+	spin_lock_irq(&data->dev_lock);
+	if (data->txn_owner == file_data) {
+		/* its urbs are still posted: the transaction goes on */
+		if (usbtmc_in_posted(file_data))
+			cont = true;
+		else if (!cont)
+			data->txn_owner = NULL;
+	}
+	/* behind the waiters of the same or a higher priority */
+	list_for_each_entry(pos, &data->txn_queue, list) {
+		if (pos->priority < w.priority)
+			break;
+	}
+	list_add_tail(&w.list, &pos->list);
+
+	while (!usbtmc_txn_ready(data, &w, cont)) {
+		if (data->txn_owner && !data->txn_busy &&
+		    !time_before(jiffies, data->txn_expires) &&
+		    usbtmc_in_posted(data->txn_owner)) {
+			rv = -EBUSY;
+			break;
+		}
+		tmo = MAX_SCHEDULE_TIMEOUT;
+		if (data->txn_owner)
+			tmo = max_t(long, (long)(data->txn_expires - jiffies), 1);
+		rv = wait_event_interruptible_lock_irq_timeout(data->txn_wait,
+				usbtmc_txn_ready(data, &w, cont),
+				data->dev_lock, tmo);
+		if (rv < 0)
+			break;
+		rv = 0;
+	}
+
+	list_del(&w.list);
+	if (!rv && data->zombie)
+		rv = -ENODEV;
+	if (!rv) {
+		if (data->txn_owner && data->txn_owner != file_data) {
+			dev_dbg(&data->intf->dev, "%s: response of another handle not read\n",
+				__func__);
+			data->txn_owner = NULL;
+		}
+		data->txn_busy = true;
+	}
+	spin_unlock_irq(&data->dev_lock);
+
+	/* the next waiter may be at the head now */
+	if (rv)
+		wake_up_all(&data->txn_wait);
+	return rv;
+}
+
+/* What the end of a turn leaves for the next turn of the handle */
+enum usbtmc_txn_hold {
+	USBTMC_TXN_RELEASE,	/* transaction complete */
+	USBTMC_TXN_REPLY,	/* message sent, a response may follow */
+	USBTMC_TXN_PENDING,	/* message or response incomplete */
+};
+
+/*
+ * Ends the turn. After a complete message the device is reserved for
+ * the response for the IO timeout of the handle, at most txn_hold_ms
+ * when that is set. An incomplete message or response, or bulk in urbs
+ * left posted, always keep the device for the handle.
+ */
+static void usbtmc_txn_end(struct usbtmc_file_data *file_data,
+			   enum usbtmc_txn_hold hold)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	unsigned int limit = READ_ONCE(data->txn_hold_ms);
+	unsigned int ms = 0;
+
+	if (usbtmc_in_posted(file_data))
+		hold = USBTMC_TXN_PENDING;
+
+	if (hold == USBTMC_TXN_REPLY)
+		ms = limit ? min(READ_ONCE(file_data->timeout), limit) :
+			READ_ONCE(file_data->timeout);
+	else if (hold == USBTMC_TXN_PENDING)
+		ms = READ_ONCE(file_data->timeout);
+
+	spin_lock_irq(&data->dev_lock);
+	data->txn_busy = false;
+	if (ms) {
+		data->txn_owner = file_data;
+		data->txn_expires = jiffies + msecs_to_jiffies(ms);
+	} else if (data->txn_owner == file_data) {
+		data->txn_owner = NULL;
+	}
+	spin_unlock_irq(&data->dev_lock);
+	wake_up_all(&data->txn_wait);
+}
+
+/* Drops the reservation of a closing file handle */
+static void usbtmc_txn_forget(struct usbtmc_file_data *file_data)
+{
+	struct usbtmc_device_data *data = file_data->data;
+
+	spin_lock_irq(&data->dev_lock);
+	if (data->txn_owner == file_data)
+		data->txn_owner = NULL;
+	spin_unlock_irq(&data->dev_lock);
+	wake_up_all(&data->txn_wait);
+}
+
+/* Hold after a read: the response is incomplete without EOM */
+static enum usbtmc_txn_hold usbtmc_read_hold(struct usbtmc_file_data *file_data)
+{
+	if (file_data->bmTransferAttributes & 1) /* EOM */
+		return USBTMC_TXN_RELEASE;
+	return USBTMC_TXN_PENDING;
+}
+
+/* Hold after a write: the next write continues a message without EOM */
+static enum usbtmc_txn_hold usbtmc_write_hold(struct usbtmc_file_data *file_data)
+{
+	if (file_data->out_msg_open)
+		return USBTMC_TXN_PENDING;
+	return USBTMC_TXN_REPLY;
+}
+
 static int usbtmc_open(struct inode *inode, struct file *filp)
 {
 	struct usb_interface *intf;
@@ -220,9 +589,13 @@ static int usbtmc_open(struct inode *inode, struct file *filp)
 	spin_lock_init(&file_data->err_lock);
 	init_usb_anchor(&file_data->submitted_in);
 	init_usb_anchor(&file_data->submitted_out);
+	init_usb_anchor(&file_data->submitted_zc);
 	init_usb_anchor(&file_data->in_anchor);
 	usbtmc_init_list(&file_data->stashed_urbs);
+	usbtmc_init_list(&file_data->stashed_in_urbs);
+	usbtmc_init_list(&file_data->stashed_sg_urbs);
 	init_waitqueue_head(&file_data->wait_bulk_in);
+	init_waitqueue_head(&file_data->poll_wait);
 
 	data = usb_get_intfdata(intf);
 	/* Protect reference to data from file structure until release */
@@ -232,17 +605,23 @@ static int usbtmc_open(struct inode *inode, struct file *filp)
 	file_data->data = data;
 
 	atomic_set(&file_data->closing, 0);
+	atomic_set(&file_data->zc_out_in_flight, 0);
 
 	file_data->timeout = usb_timeout;
 	file_data->term_char = '\n';
 	file_data->term_char_enabled = 0;
 	file_data->auto_abort = 0;
 	file_data->eom_val = 1;
+	file_data->in_depth.max = data->in_queue_depth;
+	file_data->out_depth.max = data->out_queue_depth;
+	file_data->bin_bsiz = data->bin_bsiz;
+	file_data->bout_bsiz = data->bout_bsiz;
 
 	INIT_LIST_HEAD(&file_data->file_elem);
 	spin_lock_irq(&data->dev_lock);
-	list_add_tail(&file_data->file_elem, &data->file_list);
+	list_add_tail_rcu(&file_data->file_elem, &data->file_list);
 	spin_unlock_irq(&data->dev_lock);
+	data->nr_handles++;
 	mutex_unlock(&data->io_mutex);
 
 	/* Store pointer in file structure's private data field */
@@ -270,7 +649,10 @@ static int usbtmc_flush(struct file *file, fl_owner_t id)
 	mutex_lock(&data->io_mutex);
 
 	usbtmc_draw_down(file_data);
+	usbtmc_ring_stop(file_data);
+	usbtmc_stream_stop(file_data);
         usbtmc_release_out_urbs(file_data);
+	usbtmc_release_in_urbs(file_data);
 
 	spin_lock_irq(&file_data->err_lock);
 	file_data->in_status = 0;
@@ -282,6 +664,7 @@ static int usbtmc_flush(struct file *file, fl_owner_t id)
 
 	wake_up_interruptible_all(&data->waitq);
 	mutex_unlock(&data->io_mutex);
+	usbtmc_txn_forget(file_data);
 
 	return 0;
 }
@@ -290,31 +673,47 @@ static int usbtmc_release(struct inode *inode, struct file *file)
 {
 	struct usbtmc_file_data *file_data = file->private_data;
 
-	/* prevent IO _AND_ usbtmc_interrupt */
+	/* prevent IO, usbtmc_interrupt() is a file_list RCU reader */
 	mutex_lock(&file_data->data->io_mutex);
 	spin_lock_irq(&file_data->data->dev_lock);
 
-	list_del(&file_data->file_elem);
+	list_del_rcu(&file_data->file_elem);
 
 	spin_unlock_irq(&file_data->data->dev_lock);
+	file_data->data->nr_handles--;
+	usbtmc_ring_free(file_data);
 	mutex_unlock(&file_data->data->io_mutex);
 
 	kref_put(&file_data->data->kref, usbtmc_delete);
 	file_data->data = NULL;
-	kfree(file_data);
+	/* usbtmc_interrupt() may still walk over the file handle */
+	kfree_rcu(file_data, rcu);
 	return 0;
 }
 
+/*
+ * Buffer size for emptying the bulk in endpoint in abort and clear.
+ * Whole packets, bounded so that a multi-megabyte bin_bsiz does not
+ * need a large allocation.
+ */
+static u32 usbtmc_drain_size(struct usbtmc_device_data *data)
+{
+	if (data->bin_bsiz <= USBTMC_BUFSIZE)
+		return max_t(u32, data->bin_bsiz, 2);
+	return rounddown(USBTMC_BUFSIZE, data->bin_maxp);
+}
+
 static int usbtmc_ioctl_abort_bulk_in_tag(struct usbtmc_device_data *data,
 					  u8 tag)
 {
+	const u32 bufsize = usbtmc_drain_size(data);
 	u8 *buffer;
 	struct device *dev = &data->intf->dev;
 	int rv;
 	int n;
 	int actual;
 
-	buffer = kmalloc(data->bin_bsiz, GFP_KERNEL);
+	buffer = kmalloc(bufsize, GFP_KERNEL);
 	if (!buffer)
 		return -ENOMEM;
 
@@ -367,7 +766,7 @@ usbtmc_abort_bulk_in_status:
 	rv = usb_bulk_msg(data->usb_dev,
 			  usb_rcvbulkpipe(data->usb_dev,
 					  data->bulk_in),
-			  buffer, data->bin_bsiz,
+			  buffer, bufsize,
 			  &actual, 300);
 
 	print_hex_dump_debug("usbtmc ", DUMP_PREFIX_NONE, 16, 1,
@@ -381,7 +780,7 @@ usbtmc_abort_bulk_in_status:
 			goto exit;
 	}
 
-	if (actual == data->bin_bsiz)
+	if (actual == bufsize)
 		goto usbtmc_abort_bulk_in_status;
 
 	if (n >= USBTMC_MAX_READS_TO_CLEAR_BULK_IN) {
@@ -628,15 +1027,13 @@ static int usbtmc_ioctl_get_srq_stb(struct usbtmc_file_data *file_data,
 	__u8 stb = 0;
 	int rv;
 
-	spin_lock_irq(&data->dev_lock);
+	/* pairs with atomic_set_release() in usbtmc_interrupt() */
 	srq_asserted  = atomic_xchg(&file_data->srq_asserted, srq_asserted);
 
 	if (srq_asserted) {
-		stb = file_data->srq_byte;
-		spin_unlock_irq(&data->dev_lock);
+		stb = READ_ONCE(file_data->srq_byte);
 		rv = put_user(stb, (__u8 __user *)arg);
 	} else {
-		spin_unlock_irq(&data->dev_lock);
 		rv = -ENOMSG;
 	}
 
@@ -664,18 +1061,15 @@ static int usbtmc488_ioctl_wait_srq(struct usbtmc_file_data *file_data,
 
 	expire = msecs_to_jiffies(timeout);
 
-	mutex_unlock(&data->io_mutex);
-
+	/* called without locks */
 	wait_rv = wait_event_interruptible_timeout(
 		data->waitq,
 		atomic_read(&file_data->srq_asserted) != 0 ||
-		atomic_read(&file_data->closing),
+		atomic_read(&file_data->closing) || READ_ONCE(data->zombie),
 		expire);
 
-	mutex_lock(&data->io_mutex);
-
 	/* Note! disconnect or close could be called in the meantime */
-	if (atomic_read(&file_data->closing) || data->zombie)
+	if (atomic_read(&file_data->closing) || READ_ONCE(data->zombie))
 		return -ENODEV;
 
 	if (wait_rv < 0) {
@@ -749,8 +1143,50 @@ static int usbtmc488_ioctl_simple(struct usbtmc_device_data *data,
 
 static int send_bulk_out_header(struct usbtmc_file_data *file_data, const u8 *header_data);
 
-static struct urb *usbtmc_create_urb(size_t io_buffer_size)
+/*
+ * Memory budget for urb buffers (sysfs urb_memory_limit)
+ *
+ * Buffers are charged to the file handle and the device. When the device
+ * is over its limit idle stashes are trimmed and a handle only gets new
+ * buffers while it holds less than its fair share, the limit divided by
+ * the number of open handles. A handle without urbs in use can always
+ * get one so that IO makes progress.
+ */
+static void usbtmc_charge(struct usbtmc_file_data *file_data, long bytes)
+{
+	/* io_mutex held */
+	file_data->urb_mem += bytes;
+	atomic_long_add(bytes, &file_data->data->urb_mem);
+}
+
+static bool usbtmc_over_budget(struct usbtmc_device_data *data)
+{
+	unsigned long limit = READ_ONCE(data->urb_mem_limit);
+
+	return limit && atomic_long_read(&data->urb_mem) > limit;
+}
+
+static void usbtmc_trim_stashes(struct usbtmc_device_data *data);
+
+static bool usbtmc_budget_ok(struct usbtmc_file_data *file_data, size_t size)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	unsigned long limit = READ_ONCE(data->urb_mem_limit);
+
+	if (!limit || atomic_long_read(&data->urb_mem) + size <= limit)
+		return true;
+
+	usbtmc_trim_stashes(data);
+	if (atomic_long_read(&data->urb_mem) + size <= limit)
+		return true;
+
+	return file_data->urb_mem + size <= limit / max(data->nr_handles, 1U);
+}
+
+static struct urb *usbtmc_create_urb(struct usbtmc_file_data *file_data,
+				     size_t io_buffer_size)
 {
+	struct usbtmc_device_data *data = file_data->data;
 	const size_t bufsize = io_buffer_size;
 	u8 *dmabuf = NULL;
 	struct urb *urb = usb_alloc_urb(0, GFP_KERNEL);
@@ -758,26 +1194,248 @@ static struct urb *usbtmc_create_urb(size_t io_buffer_size)
 	if (!urb)
 		return NULL;
 
-	dmabuf = kzalloc(bufsize, GFP_KERNEL);
-	if (!dmabuf) {
-		usb_free_urb(urb);
-		return NULL;
+	if (data->coherent_buffers) {
+		/* mapped once, no dma map/unmap on each submit */
+		dmabuf = usb_alloc_coherent(data->usb_dev, bufsize, GFP_KERNEL,
+					    &urb->transfer_dma);
+		if (!dmabuf) {
+			usb_free_urb(urb);
+			return NULL;
+		}
+		memset(dmabuf, 0, bufsize);
+		urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	} else if (bufsize <= usbtmc_buf_cache_size) {
+		dmabuf = mempool_alloc(data->buf_pool, GFP_NOWAIT | __GFP_NOWARN);
+		if (!dmabuf) {
+			/*
+			 * io_mutex held: the shrinker skips the stashes, so
+			 * give their buffers back to the pool before waiting
+			 * for a reserved one.
+			 */
+			usbtmc_trim_stashes(data);
+			dmabuf = mempool_alloc(data->buf_pool, GFP_KERNEL);
+		}
+		memset(dmabuf, 0, bufsize);
+	} else {
+		/* larger than the pool objects */
+		dmabuf = kzalloc(bufsize, GFP_KERNEL | __GFP_NOWARN);
+		if (!dmabuf) {
+			usb_free_urb(urb);
+			return NULL;
+		}
+		urb->transfer_flags |= URB_FREE_BUFFER;
 	}
 
 	urb->transfer_buffer = dmabuf;
 	urb->transfer_buffer_length = bufsize;
-	urb->transfer_flags |= URB_FREE_BUFFER;
+	usbtmc_charge(file_data, bufsize);
 	return urb;
 }
 
+/*
+ * Frees an urb from usbtmc_create_urb(). Must be the last reference,
+ * io_buffer_size must be the size it was created with.
+ */
+static void usbtmc_destroy_urb(struct usbtmc_file_data *file_data,
+			       struct urb *urb, size_t io_buffer_size)
+{
+	struct usbtmc_device_data *data = file_data->data;
+
+	usbtmc_charge(file_data, -(long)io_buffer_size);
+	if (urb->transfer_flags & URB_NO_TRANSFER_DMA_MAP)
+		usb_free_coherent(data->usb_dev, io_buffer_size,
+				  urb->transfer_buffer, urb->transfer_dma);
+	else if (!(urb->transfer_flags & URB_FREE_BUFFER))
+		mempool_free(urb->transfer_buffer, data->buf_pool);
+	usb_free_urb(urb);
+}
+
+/*
+ * Shrinker for the urbs stashed by idle file handles. Handles doing IO
+ * hold io_mutex and are skipped.
+ */
+static struct usbtmc_device_data *usbtmc_shrinker_data(struct shrinker *shrink)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	return shrink->private_data;
+#else
+	return container_of(shrink, struct usbtmc_device_data, shrinker);
+#endif
+}
+
+static unsigned long usbtmc_shrink_count(struct shrinker *shrink,
+					 struct shrink_control *sc)
+{
+	struct usbtmc_device_data *data = usbtmc_shrinker_data(shrink);
+	struct usbtmc_file_data *file_data;
+	struct list_head *elem;
+	unsigned long count = 0;
+
+	if (!mutex_trylock(&data->io_mutex))
+		return 0;
+
+	list_for_each_entry(file_data, &data->file_list, file_elem) {
+		count += file_data->in_urbs_stashed + file_data->sg_urbs_stashed;
+		spin_lock_irq(&file_data->stashed_urbs.lock);
+		list_for_each(elem, &file_data->stashed_urbs.urb_list)
+			count++;
+		spin_unlock_irq(&file_data->stashed_urbs.lock);
+	}
+
+	mutex_unlock(&data->io_mutex);
+	return count ? count : SHRINK_EMPTY;
+}
+
+static unsigned long usbtmc_shrink_scan(struct shrinker *shrink,
+					struct shrink_control *sc)
+{
+	struct usbtmc_device_data *data = usbtmc_shrinker_data(shrink);
+	struct usbtmc_file_data *file_data;
+	unsigned long freed = 0;
+	struct urb *urb;
+
+	if (!mutex_trylock(&data->io_mutex))
+		return SHRINK_STOP;
+
+	list_for_each_entry(file_data, &data->file_list, file_elem) {
+		while (freed < sc->nr_to_scan) {
+			spin_lock_irq(&file_data->stashed_urbs.lock);
+			urb = list_first_entry_or_null(&file_data->stashed_urbs.urb_list,
+						       struct urb, urb_list);
+			if (urb) {
+				list_del(&urb->urb_list);
+				file_data->out_urbs_used--;
+			}
+			spin_unlock_irq(&file_data->stashed_urbs.lock);
+			if (!urb)
+				break;
+			usbtmc_destroy_urb(file_data, urb, file_data->bout_bsiz);
+			freed++;
+		}
+
+		while (freed < sc->nr_to_scan) {
+			spin_lock_irq(&file_data->stashed_in_urbs.lock);
+			urb = list_first_entry_or_null(&file_data->stashed_in_urbs.urb_list,
+						       struct urb, urb_list);
+			if (urb) {
+				list_del(&urb->urb_list);
+				file_data->in_urbs_stashed--;
+			}
+			spin_unlock_irq(&file_data->stashed_in_urbs.lock);
+			if (!urb)
+				break;
+			usbtmc_destroy_urb(file_data, urb, file_data->bin_bsiz);
+			freed++;
+		}
+
+		while (freed < sc->nr_to_scan) {
+			spin_lock_irq(&file_data->stashed_sg_urbs.lock);
+			urb = list_first_entry_or_null(&file_data->stashed_sg_urbs.urb_list,
+						       struct urb, urb_list);
+			if (urb) {
+				list_del(&urb->urb_list);
+				file_data->sg_urbs_stashed--;
+			}
+			spin_unlock_irq(&file_data->stashed_sg_urbs.lock);
+			if (!urb)
+				break;
+			usbtmc_destroy_sg_urb(file_data, urb);
+			freed++;
+		}
+	}
+
+	mutex_unlock(&data->io_mutex);
+
+	dev_dbg(&data->intf->dev, "%s: freed %lu urbs\n", __func__, freed);
+	return freed;
+}
+
+static int usbtmc_alloc_buf_pool(struct usbtmc_device_data *data)
+{
+	data->buf_pool = mempool_create_slab_pool(USBTMC_POOL_RESERVE,
+						  usbtmc_buf_cache);
+	if (!data->buf_pool)
+		return -ENOMEM;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	data->shrinker = shrinker_alloc(0, "usbtmc-%s",
+					dev_name(&data->intf->dev));
+	if (!data->shrinker)
+		return -ENOMEM;
+	data->shrinker->count_objects = usbtmc_shrink_count;
+	data->shrinker->scan_objects = usbtmc_shrink_scan;
+	data->shrinker->private_data = data;
+	shrinker_register(data->shrinker);
+#else
+	data->shrinker.count_objects = usbtmc_shrink_count;
+	data->shrinker.scan_objects = usbtmc_shrink_scan;
+	data->shrinker.seeks = DEFAULT_SEEKS;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+	if (register_shrinker(&data->shrinker, "usbtmc-%s",
+			      dev_name(&data->intf->dev)))
+#else
+	if (register_shrinker(&data->shrinker))
+#endif
+		return -ENOMEM;
+	data->shrinker_registered = true;
+#endif
+
+	dev_dbg(&data->intf->dev, "bulk buffer pool: %u bytes, %d reserved\n",
+		usbtmc_buf_cache_size, USBTMC_POOL_RESERVE);
+	return 0;
+}
+
+static void usbtmc_free_buf_pool(struct usbtmc_device_data *data)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	shrinker_free(data->shrinker);
+#else
+	if (data->shrinker_registered)
+		unregister_shrinker(&data->shrinker);
+#endif
+	mempool_destroy(data->buf_pool);
+}
+
+/*
+ * Adaptive queue depth: a transfer that needed more urbs than the depth
+ * allows and found the endpoint without posted urbs doubles the depth.
+ * USBTMC_ADAPT_SHRINK_AFTER such transfers in a row that never ran dry
+ * reduce it by a quarter.
+ */
+static void usbtmc_adapt_depth(struct usbtmc_file_data *file_data,
+			       struct usbtmc_depth *depth, const char *dir)
+{
+	u32 old = depth->max;
+
+	if (file_data->adaptive_depth && depth->refilled) {
+		if (depth->starved) {
+			depth->max = min_t(u32, depth->max * 2,
+					   USBTMC_MAX_QUEUE_DEPTH);
+			depth->calm = 0;
+		} else if (++depth->calm >= USBTMC_ADAPT_SHRINK_AFTER) {
+			depth->max = max_t(u32, depth->max - depth->max / 4,
+					   USBTMC_MIN_QUEUE_DEPTH);
+			depth->calm = 0;
+		}
+		if (depth->max != old)
+			dev_dbg(&file_data->data->intf->dev,
+				"%s: %s queue depth %u -> %u\n",
+				__func__, dir, old, depth->max);
+	}
+	depth->refilled = false;
+	depth->starved = false;
+}
+
 static int usbtmc_new_out_urb(struct usbtmc_file_data *file_data, struct urb **urb, int flags) {
 	struct usbtmc_device_data *data = file_data->data;
 	struct urb *murb;
 	unsigned long expire;
 
 	if (list_empty(&file_data->stashed_urbs.urb_list)) {
-		if (file_data->out_urbs_used < MAX_URBS_IN_FLIGHT) {
-			murb = usbtmc_create_urb(data->bout_bsiz);
+		if (file_data->out_urbs_used < file_data->out_depth.max &&
+		    (file_data->out_urbs_used == 0 ||
+		     usbtmc_budget_ok(file_data, file_data->bout_bsiz))) {
+			murb = usbtmc_create_urb(file_data, file_data->bout_bsiz);
 			if (!murb)
 				return -ENOMEM;
 			file_data->out_urbs_used++;
@@ -803,7 +1461,7 @@ static int usbtmc_new_out_urb(struct usbtmc_file_data *file_data, struct urb **u
 		list_del(&murb->urb_list);
 		spin_unlock_irq(&file_data->stashed_urbs.lock);
 		/* Restore transfer_buffer_length which gets killed in usb_fill_bulk_urb() */
-		murb->transfer_buffer_length = data->bout_bsiz;
+		murb->transfer_buffer_length = file_data->bout_bsiz;
 
 	}
 out:
@@ -830,347 +1488,1566 @@ static void usbtmc_recover_out_urbs(struct usbtmc_file_data *file_data)
 	}
 }
 
-static void usbtmc_release_out_urbs(struct usbtmc_file_data *file_data)
+/* Frees the stashed bulk out urbs, returns the number freed */
+static int __usbtmc_release_out_urbs(struct usbtmc_file_data *file_data)
 {
-	struct urb *urb;
+	struct urb *urb, *next;
+	LIST_HEAD(urbs);
 	int count = 0;
 
+	/* coherent buffers must not be freed with interrupts disabled */
 	spin_lock_irq(&file_data->stashed_urbs.lock);
-	while ((urb = list_first_entry_or_null(&file_data->stashed_urbs.urb_list,
-					       struct urb, urb_list))) {
-	       list_del(&urb->urb_list);
-	       usb_free_urb(urb);
-	       file_data->out_urbs_used--;
-	       count++;
-	       }
+	list_splice_init(&file_data->stashed_urbs.urb_list, &urbs);
 	spin_unlock_irq(&file_data->stashed_urbs.lock);
 
+	list_for_each_entry_safe(urb, next, &urbs, urb_list) {
+		list_del(&urb->urb_list);
+		usbtmc_destroy_urb(file_data, urb, file_data->bout_bsiz);
+		file_data->out_urbs_used--;
+		count++;
+	}
+
+	return count;
+}
+
+static void usbtmc_release_out_urbs(struct usbtmc_file_data *file_data)
+{
+	int count = __usbtmc_release_out_urbs(file_data);
+
 	dev_info(&file_data->data->intf->dev, "%s: out_urbs_used %d freed %d\n",
 		 __func__, file_data->out_urbs_used, count);
 }
 
-static void usbtmc_read_bulk_cb(struct urb *urb)
+/*
+ * Bulk in urbs are recycled through stashed_in_urbs in the same way as
+ * the bulk out urbs. A stashed urb holds one reference which is handed
+ * over to the caller of usbtmc_new_in_urb().
+ */
+static struct urb *usbtmc_new_in_urb(struct usbtmc_file_data *file_data)
 {
-	struct usbtmc_file_data *file_data = urb->context;
-	int status = urb->status;
-	unsigned long flags;
-
-	/* sync/async unlink faults aren't errors */
-	if (status) {
-		if (!(/* status == -ENOENT || */
-			status == -ECONNRESET ||
-			status == -EREMOTEIO || /* Short packet */
-			status == -ESHUTDOWN))
-			dev_err(&file_data->data->intf->dev,
-			"%s - nonzero read bulk status received: %d\n",
-			__func__, status);
+	struct usbtmc_device_data *data = file_data->data;
+	struct urb *urb;
 
-		spin_lock_irqsave(&file_data->err_lock, flags);
-		if (!file_data->in_status)
-			file_data->in_status = status;
-		spin_unlock_irqrestore(&file_data->err_lock, flags);
+	spin_lock_irq(&file_data->stashed_in_urbs.lock);
+	urb = list_first_entry_or_null(&file_data->stashed_in_urbs.urb_list,
+				       struct urb, urb_list);
+	if (urb) {
+		list_del(&urb->urb_list);
+		file_data->in_urbs_stashed--;
 	}
+	spin_unlock_irq(&file_data->stashed_in_urbs.lock);
 
-	spin_lock_irqsave(&file_data->err_lock, flags);
-	file_data->in_transfer_size += urb->actual_length;
-	dev_dbg(&file_data->data->intf->dev,
-		"%s - total size: %u current: %d status: %d\n",
-		__func__, file_data->in_transfer_size,
-		urb->actual_length, status);
-	spin_unlock_irqrestore(&file_data->err_lock, flags);
-	usb_anchor_urb(urb, &file_data->in_anchor);
+	if (urb) {
+		atomic_long_inc(&data->in_stash_hits);
+		/* Restore transfer_buffer_length which gets killed in usb_fill_bulk_urb() */
+		urb->transfer_buffer_length = file_data->bin_bsiz;
+		return urb;
+	}
 
-	wake_up_interruptible(&file_data->wait_bulk_in);
-	wake_up_interruptible(&file_data->data->waitq);
+	atomic_long_inc(&data->in_stash_misses);
+	return usbtmc_create_urb(file_data, file_data->bin_bsiz);
 }
 
-static inline bool usbtmc_do_transfer(struct usbtmc_file_data *file_data)
+/* Number of pages of a scatter-gather urb, 0 if the hcd has no sg support */
+static unsigned int usbtmc_sg_pages(struct usbtmc_device_data *data)
 {
-	bool data_or_error;
+	unsigned int sg_tablesize = data->usb_dev->bus->sg_tablesize;
 
-	spin_lock_irq(&file_data->err_lock);
-	data_or_error = !usb_anchor_empty(&file_data->in_anchor)
-			|| file_data->in_status;
-	spin_unlock_irq(&file_data->err_lock);
-	dev_dbg(&file_data->data->intf->dev, "%s: returns %d\n", __func__,
-		data_or_error);
-	return data_or_error;
+	if (sg_tablesize < 2)
+		return 0;
+
+	return min_t(unsigned int, sg_tablesize, USBTMC_SG_URB_SIZE / PAGE_SIZE);
 }
 
-static ssize_t usbtmc_generic_read(struct usbtmc_file_data *file_data,
-				   void __user *user_buffer,
-				   u32 transfer_size,
-				   u32 *transferred,
-				   u32 flags)
+static void usbtmc_destroy_sg_urb(struct usbtmc_file_data *file_data,
+				  struct urb *urb)
 {
-	struct usbtmc_device_data *data = file_data->data;
-	struct device *dev = &data->intf->dev;
-	u32 done = 0;
-	u32 remaining;
-	const u32 bufsize = (u32)data->bin_bsiz;
-	int retval = 0;
-	u32 max_transfer_size;
-	unsigned long expire;
-	int bufcount = 1;
-	int again = 0;
-	long wait_rv;
+	struct scatterlist *sg;
+	int i;
 
-	/* mutex already locked */
+	usbtmc_charge(file_data, -(long)(urb->num_sgs * PAGE_SIZE));
 
-	*transferred = done;
+	for_each_sg(urb->sg, sg, urb->num_sgs, i)
+		if (sg_page(sg))
+			__free_page(sg_page(sg));
+	kfree(urb->sg);
+	usb_free_urb(urb);
+}
 
-	max_transfer_size = transfer_size;
+/* Bulk in urb with a scatter-gather list of single pages */
+static struct urb *usbtmc_create_sg_urb(struct usbtmc_file_data *file_data,
+					unsigned int nr_pages)
+{
+	struct scatterlist *sg;
+	struct page *page;
+	struct urb *urb;
+	unsigned int i;
 
-	if (flags & USBTMC_FLAG_IGNORE_TRAILER) {
-		/* The device may send extra alignment bytes (up to
-		 * wMaxPacketSize – 1) to avoid sending a zero-length
-		 * packet
-		 */
-		remaining = transfer_size;
-		if ((max_transfer_size % data->bin_bsiz) == 0)
-			max_transfer_size += (data->bin_bsiz - 1);
-	} else {
-		/* round down to bufsize to avoid truncated data left */
-		if (max_transfer_size > bufsize) {
-			max_transfer_size =
-				roundup(max_transfer_size + 1 - bufsize,
-					bufsize);
+	urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!urb)
+		return NULL;
+
+	sg = kmalloc_array(nr_pages, sizeof(*sg), GFP_KERNEL);
+	if (!sg) {
+		usb_free_urb(urb);
+		return NULL;
+	}
+	sg_init_table(sg, nr_pages);
+	urb->sg = sg;
+	urb->num_sgs = nr_pages;
+	usbtmc_charge(file_data, nr_pages * PAGE_SIZE);
+
+	for (i = 0; i < nr_pages; i++) {
+		page = alloc_page(GFP_KERNEL);
+		if (!page) {
+			usbtmc_destroy_sg_urb(file_data, urb);
+			return NULL;
 		}
-		remaining = max_transfer_size;
+		sg_set_page(&sg[i], page, PAGE_SIZE, 0);
 	}
 
-	spin_lock_irq(&file_data->err_lock);
+	urb->transfer_buffer = NULL;
+	urb->transfer_buffer_length = nr_pages * PAGE_SIZE;
+	return urb;
+}
 
-	if (file_data->in_status) {
-		/* return the very first error */
-		retval = file_data->in_status;
-		spin_unlock_irq(&file_data->err_lock);
-		goto error;
+static struct urb *usbtmc_new_sg_urb(struct usbtmc_file_data *file_data)
+{
+	struct urb *urb;
+
+	spin_lock_irq(&file_data->stashed_sg_urbs.lock);
+	urb = list_first_entry_or_null(&file_data->stashed_sg_urbs.urb_list,
+				       struct urb, urb_list);
+	if (urb) {
+		list_del(&urb->urb_list);
+		file_data->sg_urbs_stashed--;
 	}
+	spin_unlock_irq(&file_data->stashed_sg_urbs.lock);
 
-	if (flags & USBTMC_FLAG_ASYNC) {
-		if (usb_anchor_empty(&file_data->in_anchor))
-			again = 1;
+	if (urb) {
+		urb->transfer_buffer_length = urb->num_sgs * PAGE_SIZE;
+		return urb;
+	}
 
-		if (file_data->in_urbs_used == 0) {
-			file_data->in_transfer_size = 0;
-			file_data->in_status = 0;
+	return usbtmc_create_sg_urb(file_data, usbtmc_sg_pages(file_data->data));
+}
+
+static void usbtmc_return_in_urb(struct usbtmc_file_data *file_data, struct urb *urb)
+{
+	if (urb->num_sgs) {
+		spin_lock_irq(&file_data->stashed_sg_urbs.lock);
+		if (file_data->sg_urbs_stashed < file_data->in_depth.max &&
+		    !usbtmc_over_budget(file_data->data)) {
+			list_add(&urb->urb_list,
+				 &file_data->stashed_sg_urbs.urb_list);
+			file_data->sg_urbs_stashed++;
+			urb = NULL;
 		}
-	} else {
-		file_data->in_transfer_size = 0;
-		file_data->in_status = 0;
+		spin_unlock_irq(&file_data->stashed_sg_urbs.lock);
+
+		if (urb)
+			usbtmc_destroy_sg_urb(file_data, urb);
+		return;
 	}
 
-	if (max_transfer_size == 0) {
-		bufcount = 0;
-	} else {
-		bufcount = roundup(max_transfer_size, bufsize) / bufsize;
-		if (bufcount > file_data->in_urbs_used)
-			bufcount -= file_data->in_urbs_used;
-		else
-			bufcount = 0;
+	if (usbtmc_over_budget(file_data->data)) {
+		usbtmc_destroy_urb(file_data, urb, file_data->bin_bsiz);
+		return;
+	}
 
-		if (bufcount + file_data->in_urbs_used > MAX_URBS_IN_FLIGHT) {
-			bufcount = MAX_URBS_IN_FLIGHT -
-					file_data->in_urbs_used;
-		}
+	spin_lock_irq(&file_data->stashed_in_urbs.lock);
+	if (file_data->in_urbs_stashed < file_data->in_depth.max) {
+		list_add(&urb->urb_list, &file_data->stashed_in_urbs.urb_list);
+		file_data->in_urbs_stashed++;
+		urb = NULL;
+	}
+	spin_unlock_irq(&file_data->stashed_in_urbs.lock);
+
+	/* stash is full */
+	if (urb)
+		usbtmc_destroy_urb(file_data, urb,
+				   file_data->bin_bsiz);
+}
+
+/* move completed urbs from in_anchor back onto the stash list */
+static void usbtmc_recover_in_urbs(struct usbtmc_file_data *file_data)
+{
+	struct urb *urb;
+
+	while ((urb = usb_get_from_anchor(&file_data->in_anchor)))
+		usbtmc_return_in_urb(file_data, urb);
+}
+
+static void usbtmc_release_in_urbs(struct usbtmc_file_data *file_data)
+{
+	struct urb *urb, *next;
+	LIST_HEAD(urbs);
+	LIST_HEAD(sg_urbs);
+	int count = 0;
+
+	/* coherent buffers must not be freed with interrupts disabled */
+	spin_lock_irq(&file_data->stashed_in_urbs.lock);
+	list_splice_init(&file_data->stashed_in_urbs.urb_list, &urbs);
+	file_data->in_urbs_stashed = 0;
+	spin_unlock_irq(&file_data->stashed_in_urbs.lock);
+
+	spin_lock_irq(&file_data->stashed_sg_urbs.lock);
+	list_splice_init(&file_data->stashed_sg_urbs.urb_list, &sg_urbs);
+	file_data->sg_urbs_stashed = 0;
+	spin_unlock_irq(&file_data->stashed_sg_urbs.lock);
+
+	list_for_each_entry_safe(urb, next, &urbs, urb_list) {
+		list_del(&urb->urb_list);
+		usbtmc_destroy_urb(file_data, urb, file_data->bin_bsiz);
+		count++;
+	}
+
+	list_for_each_entry_safe(urb, next, &sg_urbs, urb_list) {
+		list_del(&urb->urb_list);
+		usbtmc_destroy_sg_urb(file_data, urb);
+		count++;
+	}
+
+	dev_dbg(&file_data->data->intf->dev, "%s: freed %d\n",
+		__func__, count);
+}
+
+/* Frees the idle stashed urbs of all file handles */
+static void usbtmc_trim_stashes(struct usbtmc_device_data *data)
+{
+	struct usbtmc_file_data *file_data;
+	long before = atomic_long_read(&data->urb_mem);
+
+	/* io_mutex held */
+	list_for_each_entry(file_data, &data->file_list, file_elem) {
+		/* quiet, trims happen on every allocation over budget */
+		__usbtmc_release_out_urbs(file_data);
+		usbtmc_release_in_urbs(file_data);
+	}
+
+	dev_dbg(&data->intf->dev, "%s: urb memory %ld -> %ld\n", __func__,
+		before, atomic_long_read(&data->urb_mem));
+}
+
+/* Bulk buffer sizes are whole packets of at least one packet */
+static u32 usbtmc_round_bsiz(u32 size, u16 maxp)
+{
+	size = clamp_t(u32, size, maxp, USBTMC_MAX_BUFSIZE);
+	return rounddown(size, maxp);
+}
+
+/*
+ * Changes the bulk urb buffer sizes of an idle file handle. The stashed
+ * urbs have the old sizes and are freed, new ones are created on demand.
+ * A size of 0 keeps the current size. Called with io_mutex held.
+ */
+static int usbtmc_set_bsiz(struct usbtmc_file_data *file_data,
+			   u32 in_size, u32 out_size)
+{
+	struct usbtmc_device_data *data = file_data->data;
+
+	if (!usb_anchor_empty(&file_data->submitted_in) ||
+	    !usb_anchor_empty(&file_data->in_anchor) ||
+	    !usb_anchor_empty(&file_data->submitted_out) ||
+	    !usb_anchor_empty(&file_data->submitted_zc) ||
+	    file_data->in_streaming || file_data->in_partial ||
+	    file_data->ring)
+		return -EBUSY;
+
+	if (in_size)
+		in_size = usbtmc_round_bsiz(in_size, data->bin_maxp);
+	else
+		in_size = file_data->bin_bsiz;
+	if (out_size)
+		out_size = usbtmc_round_bsiz(out_size, data->bout_maxp);
+	else
+		out_size = file_data->bout_bsiz;
+
+	if (in_size == file_data->bin_bsiz && out_size == file_data->bout_bsiz)
+		return 0;
+
+	usbtmc_release_out_urbs(file_data);
+	usbtmc_release_in_urbs(file_data);
+	file_data->bin_bsiz = in_size;
+	file_data->bout_bsiz = out_size;
+
+	dev_dbg(&data->intf->dev, "%s: in %u out %u\n", __func__,
+		in_size, out_size);
+	return 0;
+}
+
+static void usbtmc_read_bulk_cb(struct urb *urb)
+{
+	struct usbtmc_file_data *file_data = urb->context;
+	int status = urb->status;
+	unsigned long flags;
+
+	/* sync/async unlink faults aren't errors */
+	if (status) {
+		if (!(/* status == -ENOENT || */
+			status == -ECONNRESET ||
+			status == -EREMOTEIO || /* Short packet */
+			status == -ESHUTDOWN))
+			dev_err(&file_data->data->intf->dev,
+			"%s - nonzero read bulk status received: %d\n",
+			__func__, status);
+
+		spin_lock_irqsave(&file_data->err_lock, flags);
+		if (!file_data->in_status)
+			file_data->in_status = status;
+		spin_unlock_irqrestore(&file_data->err_lock, flags);
 	}
+
+	spin_lock_irqsave(&file_data->err_lock, flags);
+	file_data->in_transfer_size += urb->actual_length;
+	dev_dbg(&file_data->data->intf->dev,
+		"%s - total size: %u current: %d status: %d\n",
+		__func__, file_data->in_transfer_size,
+		urb->actual_length, status);
+	spin_unlock_irqrestore(&file_data->err_lock, flags);
+	usb_anchor_urb(urb, &file_data->in_anchor);
+
+	wake_up_interruptible(&file_data->wait_bulk_in);
+	wake_up_interruptible(&file_data->data->waitq);
+	usbtmc_wake_poll(file_data, EPOLLIN | EPOLLRDNORM |
+			 EPOLLOUT | EPOLLWRNORM | EPOLLERR);
+}
+
+static inline bool usbtmc_do_transfer(struct usbtmc_file_data *file_data)
+{
+	bool data_or_error;
+
+	spin_lock_irq(&file_data->err_lock);
+	data_or_error = !usb_anchor_empty(&file_data->in_anchor)
+			|| file_data->in_status;
 	spin_unlock_irq(&file_data->err_lock);
+	dev_dbg(&file_data->data->intf->dev, "%s: returns %d\n", __func__,
+		data_or_error);
+	return data_or_error;
+}
 
-	dev_dbg(dev, "%s: requested=%u flags=0x%X size=%u bufs=%d used=%d\n",
-		__func__, transfer_size, flags,
-		max_transfer_size, bufcount, file_data->in_urbs_used);
+/* True when a bulk in urb can be posted within the memory budget */
+static bool usbtmc_in_urb_available(struct usbtmc_file_data *file_data)
+{
+	struct usbtmc_device_data *data = file_data->data;
 
-	while (bufcount > 0) {
-		u8 *dmabuf = NULL;
-		struct urb *urb = usbtmc_create_urb(data->bin_bsiz);
+	if (file_data->in_sg)
+		return file_data->sg_urbs_stashed ||
+			usbtmc_budget_ok(file_data,
+					 usbtmc_sg_pages(data) * PAGE_SIZE);
 
-		if (!urb) {
-			retval = -ENOMEM;
-			goto error;
-		}
+	return file_data->in_urbs_stashed ||
+		usbtmc_budget_ok(file_data, file_data->bin_bsiz);
+}
+
+/* Post count bulk in urbs of bin_bsiz bytes on submitted_in */
+static int usbtmc_submit_in_urbs(struct usbtmc_file_data *file_data, int count)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct urb *urb;
+	int retval;
 
-		dmabuf = urb->transfer_buffer;
+	while (count > 0) {
+		/* over budget: continue with the urbs already posted */
+		if (file_data->in_urbs_used > 0 && !usbtmc_in_urb_available(file_data))
+			break;
+
+		if (file_data->in_sg)
+			urb = usbtmc_new_sg_urb(file_data);
+		else
+			urb = usbtmc_new_in_urb(file_data);
+		if (!urb)
+			return -ENOMEM;
 
 		usb_fill_bulk_urb(urb, data->usb_dev,
 			usb_rcvbulkpipe(data->usb_dev, data->bulk_in),
-			dmabuf, bufsize,
+			urb->transfer_buffer, urb->transfer_buffer_length,
 			usbtmc_read_bulk_cb, file_data);
 
 		usb_anchor_urb(urb, &file_data->submitted_in);
 		retval = usb_submit_urb(urb, GFP_KERNEL);
-		/* urb is anchored. We can release our reference. */
-		usb_free_urb(urb);
 		if (unlikely(retval)) {
 			usb_unanchor_urb(urb);
-			goto error;
+			usbtmc_return_in_urb(file_data, urb);
+			return retval;
 		}
+		/* urb is anchored. We can release our reference. */
+		usb_free_urb(urb);
 		file_data->in_urbs_used++;
-		bufcount--;
+		count--;
+	}
+	return 0;
+}
+
+/*
+ * Read-ahead streaming (USBTMC_FLAG_STREAM)
+ *
+ * The bulk in urbs stay posted between USBTMC_IOCTL_READ calls until the
+ * end of the transfer (short packet) is consumed or the stream is
+ * cancelled, so the device never sees an idle bulk in endpoint while
+ * a large response is read in chunks. Unread data of the last urb is
+ * kept in in_partial for the next call.
+ */
+static int usbtmc_stream_fill(struct usbtmc_file_data *file_data)
+{
+	if (file_data->in_stream_eom ||
+	    file_data->in_urbs_used >= file_data->in_depth.max)
+		return 0;
+
+	return usbtmc_submit_in_urbs(file_data, file_data->in_depth.max -
+				     file_data->in_urbs_used);
+}
+
+static void usbtmc_stream_stop(struct usbtmc_file_data *file_data)
+{
+	if (!file_data->in_streaming)
+		return;
+
+	file_data->in_streaming = false;
+	usb_kill_anchored_urbs(&file_data->submitted_in);
+	usbtmc_recover_in_urbs(file_data);
+	if (file_data->in_partial) {
+		usbtmc_return_in_urb(file_data, file_data->in_partial);
+		file_data->in_partial = NULL;
+	}
+	file_data->in_urbs_used = 0;
+
+	spin_lock_irq(&file_data->err_lock);
+	file_data->in_status = 0;
+	spin_unlock_irq(&file_data->err_lock);
+}
+
+static ssize_t usbtmc_stream_read(struct usbtmc_file_data *file_data,
+				  void __user *user_buffer,
+				  u32 transfer_size,
+				  u32 *transferred)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct device *dev = &data->intf->dev;
+	const u32 bufsize = (u32)file_data->bin_bsiz;
+	unsigned long expire;
+	u32 done = 0;
+	int retval;
+	long wait_rv;
+
+	/* mutex already locked */
+
+	*transferred = 0;
+
+	if (!file_data->in_streaming) {
+		/* asynchronous read in progress */
+		if (file_data->in_urbs_used)
+			return -EBUSY;
+
+		spin_lock_irq(&file_data->err_lock);
+		file_data->in_transfer_size = 0;
+		file_data->in_status = 0;
+		spin_unlock_irq(&file_data->err_lock);
+
+		file_data->in_streaming = true;
+		file_data->in_stream_eom = false;
+		file_data->in_partial_offset = 0;
 	}
 
-	if (again) {
-		dev_dbg(dev, "%s: ret=again\n", __func__);
-		return -EAGAIN;
-	}
+	retval = usbtmc_stream_fill(file_data);
+	if (retval)
+		goto error;
+
+	if (transfer_size && user_buffer == NULL) {
+		retval = -EINVAL;
+		goto error;
+	}
+
+	expire = msecs_to_jiffies(file_data->timeout);
+
+	while (done < transfer_size) {
+		struct urb *urb = file_data->in_partial;
+		u32 this_part;
+
+		if (!urb) {
+			if (file_data->in_stream_eom)
+				break;
+
+			wait_rv = wait_event_interruptible_timeout(
+				file_data->wait_bulk_in,
+				usbtmc_do_transfer(file_data),
+				expire);
+			if (wait_rv < 0) {
+				retval = wait_rv;
+				goto error;
+			}
+			if (wait_rv == 0) {
+				retval = -ETIMEDOUT;
+				goto error;
+			}
+
+			urb = usb_get_from_anchor(&file_data->in_anchor);
+			if (!urb) {
+				spin_lock_irq(&file_data->err_lock);
+				retval = file_data->in_status;
+				spin_unlock_irq(&file_data->err_lock);
+				if (!retval)
+					retval = -EFAULT;
+				goto error;
+			}
+			file_data->in_urbs_used--;
+
+			if (urb->status) {
+				/* return the very first error */
+				spin_lock_irq(&file_data->err_lock);
+				retval = file_data->in_status;
+				spin_unlock_irq(&file_data->err_lock);
+				usbtmc_return_in_urb(file_data, urb);
+				goto error;
+			}
+
+			print_hex_dump_debug("usbtmc ", DUMP_PREFIX_NONE, 16, 1,
+				urb->transfer_buffer, urb->actual_length, true);
+
+			file_data->in_partial = urb;
+			file_data->in_partial_offset = 0;
+
+			if (urb->actual_length < bufsize) {
+				/* short packet or ZLP: the remaining urbs stay empty */
+				file_data->in_stream_eom = true;
+				usb_kill_anchored_urbs(&file_data->submitted_in);
+				usbtmc_recover_in_urbs(file_data);
+				file_data->in_urbs_used = 0;
+			}
+		}
+
+		this_part = min(urb->actual_length - file_data->in_partial_offset,
+				transfer_size - done);
+
+		if (copy_to_user(user_buffer + done,
+				 urb->transfer_buffer + file_data->in_partial_offset,
+				 this_part)) {
+			retval = -EFAULT;
+			goto error;
+		}
+		done += this_part;
+		file_data->in_partial_offset += this_part;
+
+		if (file_data->in_partial_offset == urb->actual_length) {
+			/* urb drained: reuse it to keep the endpoint busy */
+			file_data->in_partial = NULL;
+			usbtmc_return_in_urb(file_data, urb);
+			if (!file_data->in_stream_eom) {
+				file_data->in_depth.refilled = true;
+				if (usb_anchor_empty(&file_data->submitted_in))
+					file_data->in_depth.starved = true;
+			}
+			retval = usbtmc_stream_fill(file_data);
+			if (retval)
+				goto error;
+		}
+	}
+
+	*transferred = done;
+
+	if (file_data->in_stream_eom && !file_data->in_partial) {
+		/* end of transfer consumed */
+		file_data->in_streaming = false;
+		usbtmc_adapt_depth(file_data, &file_data->in_depth, "in");
+		dev_dbg(dev, "%s: done=%u ret=1 (eom)\n", __func__, done);
+		return 1;
+	}
+
+	dev_dbg(dev, "%s: done=%u used=%d partial=%u\n", __func__, done,
+		file_data->in_urbs_used,
+		file_data->in_partial ? file_data->in_partial->actual_length -
+		file_data->in_partial_offset : 0);
+	return 0;
+
+error:
+	*transferred = done;
+	usbtmc_stream_stop(file_data);
+	usbtmc_adapt_depth(file_data, &file_data->in_depth, "in");
+	dev_dbg(dev, "%s: done=%u ret=%d\n", __func__, done, retval);
+	return retval;
+}
+
+static size_t usbtmc_copy_urb_to_iter(struct urb *urb, size_t len,
+				      struct iov_iter *to)
+{
+	struct scatterlist *sg;
+	size_t copied = 0;
+	int i;
+
+	if (!urb->num_sgs)
+		return copy_to_iter(urb->transfer_buffer, len, to);
+
+	for_each_sg(urb->sg, sg, urb->num_sgs, i) {
+		size_t this_part = min_t(size_t, len - copied, sg->length);
+		size_t n;
+
+		if (!this_part)
+			break;
+		n = copy_page_to_iter(sg_page(sg), sg->offset, this_part, to);
+		copied += n;
+		if (n < this_part)
+			break;
+	}
+	return copied;
+}
+
+/*
+ * With USBTMC_FLAG_IGNORE_TRAILER receive_size bytes are expected from
+ * the device but at most transfer_size bytes are copied to user_buffer,
+ * the rest is dropped. Without the flag receive_size is not used.
+ */
+static ssize_t __usbtmc_generic_read(struct usbtmc_file_data *file_data,
+				     struct iov_iter *to,
+				     u32 transfer_size,
+				     u32 receive_size,
+				     u32 *transferred,
+				     u32 flags)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct device *dev = &data->intf->dev;
+	u32 done = 0;
+	u32 remaining;
+	u32 bufsize = (u32)file_data->bin_bsiz;
+	u32 sg_size = usbtmc_sg_pages(data) * PAGE_SIZE;
+	int retval = 0;
+	u32 max_transfer_size;
+	u32 in_flight;	/* receive space of the posted urbs */
+	u32 rest;	/* bytes not covered by the urbs posted ahead */
+	int used;
+	unsigned long expire;
+	int bufcount = 1;
+	int again = 0;
+	long wait_rv;
+
+	/* mutex already locked */
+
+	*transferred = done;
+
+	if ((file_data->ring && file_data->ring->active) ||
+	    file_data->in_streaming)
+		return -EBUSY;
+
+	/* only an async call may just post the urbs */
+	if (!to && !(flags & USBTMC_FLAG_ASYNC))
+		return -EINVAL;
+
+	max_transfer_size = transfer_size;
+
+	if (flags & USBTMC_FLAG_IGNORE_TRAILER) {
+		remaining = transfer_size;
+		max_transfer_size = receive_size;
+	} else {
+		/* round down to bufsize to avoid truncated data left */
+		if (max_transfer_size > bufsize) {
+			max_transfer_size =
+				roundup(max_transfer_size + 1 - bufsize,
+					bufsize);
+		}
+		remaining = max_transfer_size;
+	}
+
+	/* bin_bsiz urbs posted ahead, e.g. by __usbtmc_read_message() */
+	used = file_data->in_urbs_used;
+	in_flight = used * bufsize;
+	rest = max_transfer_size > in_flight ? max_transfer_size - in_flight : 0;
+
+	/*
+	 * Large synchronous reads: fewer, scatter-gather urbs for the part
+	 * not covered by the urbs posted ahead. A raw read uses them only
+	 * when none were posted ahead and they end where the bin_bsiz urbs
+	 * would, so that no urb can receive data beyond the requested size.
+	 */
+	if (!(flags & USBTMC_FLAG_ASYNC) && sg_size > bufsize &&
+	    rest >= sg_size &&
+	    ((flags & USBTMC_FLAG_IGNORE_TRAILER) ||
+	     (used == 0 && max_transfer_size % sg_size == 0))) {
+		file_data->in_sg = true;
+		bufsize = sg_size;
+	}
+
+	/* The device may send extra alignment bytes (up to
+	 * wMaxPacketSize – 1) to avoid sending a zero-length
+	 * packet
+	 */
+	if ((flags & USBTMC_FLAG_IGNORE_TRAILER) &&
+	    ((file_data->in_sg ? rest : max_transfer_size) % bufsize) == 0) {
+		max_transfer_size += (bufsize - 1);
+		rest = max_transfer_size > in_flight ?
+			max_transfer_size - in_flight : 0;
+	}
+
+	spin_lock_irq(&file_data->err_lock);
+
+	if (file_data->in_status) {
+		/* return the very first error */
+		retval = file_data->in_status;
+		spin_unlock_irq(&file_data->err_lock);
+		goto error;
+	}
+
+	if (flags & USBTMC_FLAG_ASYNC) {
+		if (usb_anchor_empty(&file_data->in_anchor))
+			again = 1;
+
+		if (file_data->in_urbs_used == 0) {
+			file_data->in_transfer_size = 0;
+			file_data->in_status = 0;
+		}
+	} else {
+		file_data->in_transfer_size = 0;
+		file_data->in_status = 0;
+	}
+
+	if (max_transfer_size == 0) {
+		bufcount = 0;
+	} else {
+		bufcount = DIV_ROUND_UP(rest, bufsize);
+
+		if (bufcount + used > file_data->in_depth.max)
+			bufcount = file_data->in_depth.max - used;
+	}
+	spin_unlock_irq(&file_data->err_lock);
+
+	dev_dbg(dev, "%s: requested=%u flags=0x%X size=%u bufs=%d used=%d sg=%d\n",
+		__func__, transfer_size, flags,
+		max_transfer_size, bufcount, used, file_data->in_sg);
+
+	retval = usbtmc_submit_in_urbs(file_data, bufcount);
+	if (retval)
+		goto error;
+	/* fewer than bufcount when over the memory budget */
+	in_flight += (file_data->in_urbs_used - used) * bufsize;
+
+	if (again) {
+		dev_dbg(dev, "%s: ret=again\n", __func__);
+		return -EAGAIN;
+	}
+
+	if (to == NULL)
+		return -EINVAL;
+
+	expire = msecs_to_jiffies(file_data->timeout);
+
+	while (max_transfer_size > 0) {
+		u32 this_part;
+		struct urb *urb = NULL;
+
+		if (!(flags & USBTMC_FLAG_ASYNC)) {
+			dev_dbg(dev, "%s: before wait time %lu\n",
+				__func__, expire);
+			wait_rv = wait_event_interruptible_timeout(
+				file_data->wait_bulk_in,
+				usbtmc_do_transfer(file_data),
+				expire);
+
+			dev_dbg(dev, "%s: wait returned %ld\n",
+				__func__, wait_rv);
+
+			if (wait_rv < 0) {
+				retval = wait_rv;
+				goto error;
+			}
+
+			if (wait_rv == 0) {
+				retval = -ETIMEDOUT;
+				goto error;
+			}
+		}
+
+		urb = usb_get_from_anchor(&file_data->in_anchor);
+		if (!urb) {
+			if (!(flags & USBTMC_FLAG_ASYNC)) {
+				/* synchronous case: must not happen */
+				retval = -EFAULT;
+				goto error;
+			}
+
+			/* asynchronous case: ready, do not block or wait */
+			*transferred = done;
+			dev_dbg(dev, "%s: (async) done=%u ret=0\n",
+				__func__, done);
+			return 0;
+		}
+
+		file_data->in_urbs_used--;
+		in_flight -= urb->transfer_buffer_length;
+
+		if (max_transfer_size > urb->actual_length)
+			max_transfer_size -= urb->actual_length;
+		else
+			max_transfer_size = 0;
+
+		if (remaining > urb->actual_length)
+			this_part = urb->actual_length;
+		else
+			this_part = remaining;
+
+		if (!urb->num_sgs)
+			print_hex_dump_debug("usbtmc ", DUMP_PREFIX_NONE, 16, 1,
+				urb->transfer_buffer, urb->actual_length, true);
+
+		if (usbtmc_copy_urb_to_iter(urb, this_part, to) != this_part) {
+			usbtmc_return_in_urb(file_data, urb);
+			retval = -EFAULT;
+			goto error;
+		}
+
+		remaining -= this_part;
+		done += this_part;
+
+		spin_lock_irq(&file_data->err_lock);
+		if (urb->status) {
+			/* return the very first error */
+			retval = file_data->in_status;
+			spin_unlock_irq(&file_data->err_lock);
+			usbtmc_return_in_urb(file_data, urb);
+			goto error;
+		}
+		spin_unlock_irq(&file_data->err_lock);
+
+		if (urb->actual_length < urb->transfer_buffer_length) {
+			/* short packet or ZLP received => ready */
+			usbtmc_return_in_urb(file_data, urb);
+			retval = 1;
+			break;
+		}
+
+		if (!(flags & USBTMC_FLAG_ASYNC) &&
+		    max_transfer_size > in_flight) {
+			/* resubmit, since other buffers still not enough */
+			file_data->in_depth.refilled = true;
+			if (usb_anchor_empty(&file_data->submitted_in))
+				file_data->in_depth.starved = true;
+			if (file_data->in_sg && !urb->num_sgs) {
+				/* an urb posted ahead: continue with sg urbs */
+				usbtmc_return_in_urb(file_data, urb);
+				used = file_data->in_urbs_used;
+				retval = usbtmc_submit_in_urbs(file_data, 1);
+				if (retval)
+					goto error;
+				in_flight += (file_data->in_urbs_used - used) *
+					     bufsize;
+				continue;
+			}
+			in_flight += urb->transfer_buffer_length;
+			usb_anchor_urb(urb, &file_data->submitted_in);
+			retval = usb_submit_urb(urb, GFP_KERNEL);
+			if (unlikely(retval)) {
+				usb_unanchor_urb(urb);
+				usbtmc_return_in_urb(file_data, urb);
+				goto error;
+			}
+			file_data->in_urbs_used++;
+			/* urb is anchored. We can release our reference. */
+			usb_free_urb(urb);
+		} else {
+			usbtmc_return_in_urb(file_data, urb);
+		}
+		retval = 0;
+	}
+
+error:
+	*transferred = done;
+
+	dev_dbg(dev, "%s: before kill\n", __func__);
+	/* Attention: killing urbs can take long time (2 ms) */
+	usb_kill_anchored_urbs(&file_data->submitted_in);
+	dev_dbg(dev, "%s: after kill\n", __func__);
+	usbtmc_recover_in_urbs(file_data);
+	file_data->in_urbs_used = 0;
+	file_data->in_status = 0; /* no spinlock needed here */
+	file_data->in_sg = false;
+	usbtmc_adapt_depth(file_data, &file_data->in_depth, "in");
+	dev_dbg(dev, "%s: done=%u ret=%d\n", __func__, done, retval);
+
+	return retval;
+}
+
+static int usbtmc_import_ubuf(int rw, void __user *buf, size_t len,
+			      struct iovec *iov, struct iov_iter *i)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+	return import_ubuf(rw, buf, len, i);
+#else
+	return import_single_range(rw, buf, len, iov, i);
+#endif
+}
+
+/* ITER_UBUF (6.0+) is copied by dup_iter() without an allocation */
+static bool usbtmc_iter_is_ubuf(const struct iov_iter *i)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+	return iter_is_ubuf(i);
+#else
+	return false;
+#endif
+}
+
+static ssize_t usbtmc_generic_read(struct usbtmc_file_data *file_data,
+				   void __user *user_buffer,
+				   u32 transfer_size,
+				   u32 *transferred,
+				   u32 flags)
+{
+	struct iovec iov;
+	struct iov_iter to;
+	int retval;
+
+	if (flags & USBTMC_FLAG_STREAM) {
+		*transferred = 0;
+		if (flags & USBTMC_FLAG_ASYNC)
+			return -EINVAL;
+		if (file_data->ring && file_data->ring->active)
+			return -EBUSY;
+		return usbtmc_stream_read(file_data, user_buffer,
+					  transfer_size, transferred);
+	}
+
+	if (user_buffer == NULL)
+		return __usbtmc_generic_read(file_data, NULL, transfer_size,
+					     transfer_size, transferred, flags);
+
+	retval = usbtmc_import_ubuf(READ, user_buffer, transfer_size,
+				    &iov, &to);
+	if (retval < 0) {
+		*transferred = 0;
+		return retval;
+	}
+
+	return __usbtmc_generic_read(file_data, &to, transfer_size,
+				     transfer_size, transferred, flags);
+}
+
+struct compat_message {
+	__u32 transfer_size;
+	__u32 transferred;
+	__u32 flags;
+	__u32 message  __attribute__ ((aligned (8)));
+} __attribute__ ((packed));
+
+static ssize_t usbtmc_ioctl_generic_read(struct usbtmc_file_data *file_data,
+					 void __user *arg)
+{
+	struct usbtmc_message msg;
+	struct compat_message *m = (struct compat_message *)&msg;
+	ssize_t retval = 0;
+
+	/* mutex already locked */
+
+	if (copy_from_user(&msg, arg, sizeof(struct usbtmc_message)))
+		return -EFAULT;
+
+	if (in_compat_syscall())
+		msg.message = compat_ptr((compat_uptr_t)m->message);
+
+	retval = usbtmc_generic_read(file_data, msg.message,
+				     msg.transfer_size, &msg.transferred,
+				     msg.flags);
+
+	if (put_user(msg.transferred,
+		     &((struct usbtmc_message __user *)arg)->transferred))
+		return -EFAULT;
+
+	return retval;
+}
+
+/*
+ * Zero copy receive ring
+ *
+ * The ring is a set of page aligned buffers that user space maps with
+ * mmap(). USBTMC_IOCTL_RING_READ posts all free buffers as bulk in urbs
+ * and returns the buffers in the order they were filled by the device.
+ * A buffer belongs to user space until it is handed back with
+ * USBTMC_IOCTL_RING_RELEASE, which reposts it while the transfer is
+ * still running. The transfer ends with a short packet (EOM flag).
+ */
+static void usbtmc_ring_bulk_cb(struct urb *urb)
+{
+	struct usbtmc_ring_slot *slot = urb->context;
+	struct usbtmc_file_data *file_data = slot->file_data;
+	int status = urb->status;
+	unsigned long flags;
+
+	/* sync/async unlink faults aren't errors */
+	if (status) {
+		if (!(status == -ENOENT ||
+		      status == -ECONNRESET ||
+		      status == -EREMOTEIO || /* Short packet */
+		      status == -ESHUTDOWN))
+			dev_err(&file_data->data->intf->dev,
+				"%s - nonzero read bulk status received: %d\n",
+				__func__, status);
+
+		spin_lock_irqsave(&file_data->err_lock, flags);
+		if (!file_data->in_status)
+			file_data->in_status = status;
+		spin_unlock_irqrestore(&file_data->err_lock, flags);
+	}
+
+	dev_dbg(&file_data->data->intf->dev, "%s - slot: %u current: %d status: %d\n",
+		__func__, slot->index, urb->actual_length, status);
+
+	usb_anchor_urb(urb, &file_data->ring->done);
+
+	wake_up_interruptible(&file_data->wait_bulk_in);
+	wake_up_interruptible(&file_data->data->waitq);
+	usbtmc_wake_poll(file_data, EPOLLIN | EPOLLRDNORM |
+			 EPOLLOUT | EPOLLWRNORM | EPOLLERR);
+}
+
+static int usbtmc_ring_post(struct usbtmc_file_data *file_data,
+			    struct usbtmc_ring_slot *slot)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_ring *ring = file_data->ring;
+	int retval;
+
+	usb_fill_bulk_urb(slot->urb, data->usb_dev,
+			  usb_rcvbulkpipe(data->usb_dev, data->bulk_in),
+			  page_address(slot->pages), ring->urb_size,
+			  usbtmc_ring_bulk_cb, slot);
+
+	usb_anchor_urb(slot->urb, &file_data->submitted_in);
+	retval = usb_submit_urb(slot->urb, GFP_KERNEL);
+	if (unlikely(retval)) {
+		usb_unanchor_urb(slot->urb);
+		return retval;
+	}
+	slot->state = USBTMC_SLOT_POSTED;
+	ring->posted++;
+	return 0;
+}
+
+/* Kill the posted buffers and make them available for the next transfer */
+static void usbtmc_ring_stop(struct usbtmc_file_data *file_data)
+{
+	struct usbtmc_ring *ring = file_data->ring;
+	struct usbtmc_ring_slot *slot;
+	struct urb *urb;
+
+	if (!ring)
+		return;
+
+	ring->active = false;
+	if (ring->posted)
+		usb_kill_anchored_urbs(&file_data->submitted_in);
+
+	while ((urb = usb_get_from_anchor(&ring->done))) {
+		slot = urb->context;
+		slot->state = USBTMC_SLOT_FREE;
+		usb_free_urb(urb);
+	}
+	ring->posted = 0;
+
+	spin_lock_irq(&file_data->err_lock);
+	file_data->in_status = 0;
+	spin_unlock_irq(&file_data->err_lock);
+}
+
+static void usbtmc_ring_free(struct usbtmc_file_data *file_data)
+{
+	struct usbtmc_ring *ring = file_data->ring;
+	u32 i;
+
+	if (!ring)
+		return;
+
+	usbtmc_ring_stop(file_data);
+
+	for (i = 0; i < ring->nr_slots; i++) {
+		usb_free_urb(ring->slots[i].urb);
+		if (ring->slots[i].pages) {
+			__free_pages(ring->slots[i].pages, ring->order);
+			usbtmc_charge(file_data,
+				      -(long)(PAGE_SIZE << ring->order));
+		}
+	}
+	/* usbtmc_poll() looks at the ring without io_mutex */
+	spin_lock_irq(&file_data->err_lock);
+	file_data->ring = NULL;
+	spin_unlock_irq(&file_data->err_lock);
+
+	kfree(ring->slots);
+	kfree(ring);
+}
+
+static int usbtmc_ring_alloc(struct usbtmc_file_data *file_data, u32 nr_slots)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_ring *ring;
+	u32 urb_size = file_data->bin_bsiz;
+	unsigned int order = get_order(PAGE_ALIGN(urb_size));
+	u32 i;
+
+	/* the slots count against urb_memory_limit like the stashed urbs */
+	if (!usbtmc_budget_ok(file_data,
+			      (size_t)nr_slots << (PAGE_SHIFT + order)))
+		return -ENOMEM;
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
+
+	ring->slots = kcalloc(nr_slots, sizeof(*ring->slots), GFP_KERNEL);
+	if (!ring->slots) {
+		kfree(ring);
+		return -ENOMEM;
+	}
+
+	ring->urb_size = urb_size;
+	ring->slot_size = PAGE_ALIGN(urb_size);
+	ring->order = order;
+	init_usb_anchor(&ring->done);
+	atomic_set(&ring->mmap_count, 0);
+	spin_lock_irq(&file_data->err_lock);
+	file_data->ring = ring;
+	spin_unlock_irq(&file_data->err_lock);
+
+	for (i = 0; i < nr_slots; i++) {
+		struct usbtmc_ring_slot *slot = &ring->slots[i];
+
+		slot->file_data = file_data;
+		slot->index = i;
+		/* zeroed since the buffers are mapped to user space */
+		slot->pages = alloc_pages(GFP_KERNEL | __GFP_ZERO, ring->order);
+		if (slot->pages)
+			usbtmc_charge(file_data, PAGE_SIZE << ring->order);
+		slot->urb = usb_alloc_urb(0, GFP_KERNEL);
+		ring->nr_slots++;
+		if (!slot->pages || !slot->urb) {
+			usbtmc_ring_free(file_data);
+			return -ENOMEM;
+		}
+	}
+
+	dev_dbg(&data->intf->dev, "%s: slots=%u slot_size=%u urb_size=%u\n",
+		__func__, ring->nr_slots, ring->slot_size, ring->urb_size);
+	return 0;
+}
+
+static int usbtmc_ioctl_ring_setup(struct usbtmc_file_data *file_data,
+				   void __user *arg)
+{
+	struct usbtmc_ring_setup setup;
+	int retval;
+
+	if (copy_from_user(&setup, arg, sizeof(setup)))
+		return -EFAULT;
+
+	if (setup.nr_slots > USBTMC_MAX_RING_SLOTS)
+		return -EINVAL;
+
+	if (file_data->ring) {
+		/* buffers are still mapped to user space */
+		if (atomic_read(&file_data->ring->mmap_count))
+			return -EBUSY;
+		usbtmc_ring_free(file_data);
+	}
+
+	setup.slot_size = 0;
+	if (setup.nr_slots) {
+		retval = usbtmc_ring_alloc(file_data, setup.nr_slots);
+		if (retval)
+			return retval;
+		setup.slot_size = file_data->ring->slot_size;
+	}
+
+	if (copy_to_user(arg, &setup, sizeof(setup)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static int usbtmc_ioctl_ring_read(struct usbtmc_file_data *file_data,
+				  void __user *arg)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct device *dev = &data->intf->dev;
+	struct usbtmc_ring *ring = file_data->ring;
+	struct usbtmc_ring_slot *slot;
+	struct usbtmc_ring_desc desc;
+	struct urb *urb;
+	unsigned long expire;
+	long wait_rv;
+	int retval;
+	u32 i;
+
+	if (!ring)
+		return -EINVAL;
+
+	if (!ring->active) {
+		/* generic read in progress */
+		if (!usb_anchor_empty(&file_data->submitted_in) ||
+		    file_data->in_streaming)
+			return -EBUSY;
+
+		spin_lock_irq(&file_data->err_lock);
+		file_data->in_transfer_size = 0;
+		file_data->in_status = 0;
+		spin_unlock_irq(&file_data->err_lock);
+
+		ring->active = true;
+		for (i = 0; i < ring->nr_slots; i++) {
+			if (ring->slots[i].state != USBTMC_SLOT_FREE)
+				continue;
+			retval = usbtmc_ring_post(file_data, &ring->slots[i]);
+			if (retval)
+				goto error;
+		}
+	}
+
+	/* all buffers are held by user space */
+	if (!ring->posted && usb_anchor_empty(&ring->done))
+		return -ENOBUFS;
+
+	/* On timeout the buffers stay posted so that the call can be repeated */
+	expire = msecs_to_jiffies(file_data->timeout);
+	wait_rv = wait_event_interruptible_timeout(file_data->wait_bulk_in,
+						   !usb_anchor_empty(&ring->done),
+						   expire);
+	if (wait_rv < 0)
+		return wait_rv;
+	if (wait_rv == 0)
+		return -ETIMEDOUT;
+
+	urb = usb_get_from_anchor(&ring->done);
+	if (!urb)
+		return -EFAULT;
+
+	slot = urb->context;
+	ring->posted--;
+	slot->state = USBTMC_SLOT_USER;
+
+	desc.slot = slot->index;
+	desc.offset = slot->index * ring->slot_size;
+	desc.length = urb->actual_length;
+	desc.flags = 0;
+
+	if (urb->status) {
+		slot->state = USBTMC_SLOT_FREE;
+		spin_lock_irq(&file_data->err_lock);
+		retval = file_data->in_status;
+		spin_unlock_irq(&file_data->err_lock);
+		usb_free_urb(urb);
+		goto error;
+	}
+
+	if (urb->actual_length < ring->urb_size) {
+		/* short packet or ZLP received => ready */
+		desc.flags |= USBTMC_RING_FLAG_EOM;
+		usbtmc_ring_stop(file_data);
+	}
+	usb_free_urb(urb);
+
+	dev_dbg(dev, "%s: slot=%u length=%u flags=0x%x posted=%u\n", __func__,
+		desc.slot, desc.length, desc.flags, ring->posted);
+
+	if (copy_to_user(arg, &desc, sizeof(desc)))
+		return -EFAULT;
+
+	return 0;
+
+error:
+	usbtmc_ring_stop(file_data);
+	dev_dbg(dev, "%s: ret=%d\n", __func__, retval);
+	return retval;
+}
+
+static int usbtmc_ioctl_ring_release(struct usbtmc_file_data *file_data,
+				     void __user *arg)
+{
+	struct usbtmc_ring *ring = file_data->ring;
+	struct usbtmc_ring_slot *slot;
+	u32 index;
+	int retval;
+
+	if (get_user(index, (__u32 __user *)arg))
+		return -EFAULT;
+
+	if (!ring || index >= ring->nr_slots)
+		return -EINVAL;
+
+	slot = &ring->slots[index];
+	if (slot->state != USBTMC_SLOT_USER)
+		return -EINVAL;
+
+	slot->state = USBTMC_SLOT_FREE;
+	if (!ring->active)
+		return 0;
+
+	/* transfer still running: repost the buffer */
+	retval = usbtmc_ring_post(file_data, slot);
+	if (retval)
+		usbtmc_ring_stop(file_data);
+
+	return retval;
+}
+
+static void usbtmc_vm_open(struct vm_area_struct *vma)
+{
+	struct usbtmc_ring *ring = vma->vm_private_data;
+
+	atomic_inc(&ring->mmap_count);
+}
+
+static void usbtmc_vm_close(struct vm_area_struct *vma)
+{
+	struct usbtmc_ring *ring = vma->vm_private_data;
+
+	atomic_dec(&ring->mmap_count);
+}
+
+static const struct vm_operations_struct usbtmc_vm_ops = {
+	.open	= usbtmc_vm_open,
+	.close	= usbtmc_vm_close,
+};
+
+static int usbtmc_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct usbtmc_file_data *file_data = filp->private_data;
+	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_ring *ring;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long addr = vma->vm_start;
+	int retval = 0;
+	u32 i;
+
+	mutex_lock(&data->io_mutex);
+
+	ring = file_data->ring;
+	if (!ring || vma->vm_pgoff ||
+	    size > (unsigned long)ring->nr_slots * ring->slot_size) {
+		retval = -EINVAL;
+		goto exit;
+	}
+
+	/* The ring is read only for user space */
+	if (vma->vm_flags & VM_WRITE) {
+		retval = -EPERM;
+		goto exit;
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+	for (i = 0; i < ring->nr_slots && addr < vma->vm_end; i++) {
+		unsigned long len = min_t(unsigned long, ring->slot_size,
+					  vma->vm_end - addr);
+
+		retval = remap_pfn_range(vma, addr,
+					 page_to_pfn(ring->slots[i].pages),
+					 len, vma->vm_page_prot);
+		if (retval)
+			goto exit;
+		addr += len;
+	}
+
+	vma->vm_private_data = ring;
+	vma->vm_ops = &usbtmc_vm_ops;
+	usbtmc_vm_open(vma);
+
+exit:
+	mutex_unlock(&data->io_mutex);
+	return retval;
+}
+
+static void usbtmc_write_bulk_cb(struct urb *urb)
+{
+	struct usbtmc_file_data *file_data = urb->context;
+	int wakeup = 0;
+	unsigned long flags, stashed_flags;
+
+	spin_lock_irqsave(&file_data->err_lock, flags);
+	file_data->out_transfer_size += urb->actual_length;
+
+	/* sync/async unlink faults aren't errors */
+	if (urb->status) {
+		if (!(urb->status == -ENOENT ||
+		      urb->status == -ECONNRESET ||
+		      urb->status == -ESHUTDOWN))
+			dev_err(&file_data->data->intf->dev,
+				"%s - nonzero write bulk status received: %d\n",
+				__func__, urb->status);
+
+		if (!file_data->out_status) {
+			file_data->out_status = urb->status;
+			wakeup = 1;
+		}
+	} else {
+		usb_get_urb(urb);
+		spin_lock_irqsave(&file_data->stashed_urbs.lock, stashed_flags);
+		list_add(&urb->urb_list, &file_data->stashed_urbs.urb_list);
+		spin_unlock_irqrestore(&file_data->stashed_urbs.lock, stashed_flags);
+		wake_up_interruptible(&file_data->stashed_urbs.waitq);
+	}
+	spin_unlock_irqrestore(&file_data->err_lock, flags);
+
+	dev_dbg(&file_data->data->intf->dev,
+		"%s - urb bufsize %u write bulk total size: %u\n",
+		__func__, urb->transfer_buffer_length, file_data->out_transfer_size);
+
+	if (usb_anchor_empty(&file_data->submitted_out) || wakeup) {
+		wake_up_interruptible(&file_data->data->waitq);
+		usbtmc_wake_poll(file_data, EPOLLOUT | EPOLLWRNORM | EPOLLERR);
+	}
+}
+
+static ssize_t __usbtmc_generic_write(struct usbtmc_file_data *file_data,
+				      struct iov_iter *from,
+				      u32 transfer_size,
+				      u32 *transferred,
+				      u32 flags)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct device *dev = &data->intf->dev;
+	u32 done = 0;
+	u32 remaining;
+	unsigned long expire;
+	const u32 bufsize = file_data->bout_bsiz;
+	struct urb *urb = NULL;
+	int retval = 0;
+	u32 timeout;
+	u32 nr_urbs = 0;
+
+	*transferred = 0;
 
-	if (user_buffer == NULL)
-		return -EINVAL;
+	dev_dbg(dev, "%s: size=%u flags=0x%X used=%u\n",
+		__func__, transfer_size, flags,
+		file_data->out_urbs_used);
 
-	expire = msecs_to_jiffies(file_data->timeout);
+	if (flags & USBTMC_FLAG_APPEND) {
+		spin_lock_irq(&file_data->err_lock);
+		retval = file_data->out_status;
+		spin_unlock_irq(&file_data->err_lock);
+		if (retval < 0)
+			return retval;
+	} else {
+		spin_lock_irq(&file_data->err_lock);
+		file_data->out_transfer_size = 0;
+		file_data->out_status = 0;
+		spin_unlock_irq(&file_data->err_lock);
+	}
 
-	while (max_transfer_size > 0) {
-		u32 this_part;
-		struct urb *urb = NULL;
+	remaining = transfer_size;
+	if (remaining > INT_MAX)
+		remaining = INT_MAX;
 
-		if (!(flags & USBTMC_FLAG_ASYNC)) {
-			dev_dbg(dev, "%s: before wait time %lu\n",
-				__func__, expire);
-			wait_rv = wait_event_interruptible_timeout(
-				file_data->wait_bulk_in,
-				usbtmc_do_transfer(file_data),
-				expire);
+	timeout = file_data->timeout;
+	expire = msecs_to_jiffies(timeout);
 
-			dev_dbg(dev, "%s: wait returned %ld\n",
-				__func__, wait_rv);
+	while (remaining > 0) {
+		u32 this_part, aligned;
+		u8 *buffer = NULL;
 
-			if (wait_rv < 0) {
-				retval = wait_rv;
-				goto error;
-			}
+		spin_lock_irq(&file_data->err_lock);
+		retval = file_data->out_status;
+		spin_unlock_irq(&file_data->err_lock);
+		if (retval < 0)
+			goto error;
 
-			if (wait_rv == 0) {
-				retval = -ETIMEDOUT;
-				goto error;
-			}
-		}
+		/* prepare next urb to send */
+		retval = usbtmc_new_out_urb(file_data, &urb, flags);
+		if (retval)
+			goto error;
 
-		urb = usb_get_from_anchor(&file_data->in_anchor);
 		if (!urb) {
-			if (!(flags & USBTMC_FLAG_ASYNC)) {
-				/* synchronous case: must not happen */
-				retval = -EFAULT;
+			if (flags & USBTMC_FLAG_ASYNC) {
+				retval = (done)?(0):(-EAGAIN);
+				goto exit;
+			} else {
+				retval = -ENOENT;
 				goto error;
 			}
-
-			/* asynchronous case: ready, do not block or wait */
-			*transferred = done;
-			dev_dbg(dev, "%s: (async) done=%u ret=0\n",
-				__func__, done);
-			return 0;
 		}
 
-		file_data->in_urbs_used--;
-
-		if (max_transfer_size > urb->actual_length)
-			max_transfer_size -= urb->actual_length;
-		else
-			max_transfer_size = 0;
+		buffer = urb->transfer_buffer;
 
-		if (remaining > urb->actual_length)
-			this_part = urb->actual_length;
+		if (remaining > bufsize)
+			this_part = bufsize;
 		else
 			this_part = remaining;
 
-		print_hex_dump_debug("usbtmc ", DUMP_PREFIX_NONE, 16, 1,
-			urb->transfer_buffer, urb->actual_length, true);
-
-		if (copy_to_user(user_buffer + done,
-				 urb->transfer_buffer, this_part)) {
-			usb_free_urb(urb);
+		if (copy_from_iter(buffer, this_part, from) != this_part) {
 			retval = -EFAULT;
+			usb_anchor_urb(urb, &file_data->submitted_out);
 			goto error;
 		}
 
-		remaining -= this_part;
-		done += this_part;
+		print_hex_dump_debug("usbtmc ", DUMP_PREFIX_NONE,
+			16, 1, buffer, this_part, true);
 
-		spin_lock_irq(&file_data->err_lock);
-		if (urb->status) {
-			/* return the very first error */
-			retval = file_data->in_status;
-			spin_unlock_irq(&file_data->err_lock);
-			usb_free_urb(urb);
-			goto error;
-		}
-		spin_unlock_irq(&file_data->err_lock);
+		/* fill bulk with 32 bit alignment to meet USBTMC specification
+		 * (size + 3 & ~3) rounds up and simplifies user code
+		 */
+		aligned = (this_part + 3) & ~3;
+		dev_dbg(dev, "write(size:%u align:%u done:%u)\n",
+			(unsigned int)this_part,
+			(unsigned int)aligned,
+			(unsigned int)done);
 
-		if (urb->actual_length < bufsize) {
-			/* short packet or ZLP received => ready */
-			usb_free_urb(urb);
-			retval = 1;
-			break;
-		}
+		usb_fill_bulk_urb(urb, data->usb_dev,
+			usb_sndbulkpipe(data->usb_dev, data->bulk_out),
+			urb->transfer_buffer, aligned,
+			usbtmc_write_bulk_cb, file_data);
 
-		if (!(flags & USBTMC_FLAG_ASYNC) &&
-		    max_transfer_size > (bufsize * file_data->in_urbs_used)) {
-			/* resubmit, since other buffers still not enough */
-			usb_anchor_urb(urb, &file_data->submitted_in);
-			retval = usb_submit_urb(urb, GFP_KERNEL);
-			if (unlikely(retval)) {
-				usb_unanchor_urb(urb);
-				usb_free_urb(urb);
-				goto error;
-			}
-			file_data->in_urbs_used++;
+		if (++nr_urbs > file_data->out_depth.max) {
+			file_data->out_depth.refilled = true;
+			if (usb_anchor_empty(&file_data->submitted_out))
+				file_data->out_depth.starved = true;
 		}
-		usb_free_urb(urb);
-		retval = 0;
-	}
-
-error:
-	*transferred = done;
 
-	dev_dbg(dev, "%s: before kill\n", __func__);
-	/* Attention: killing urbs can take long time (2 ms) */
-	usb_kill_anchored_urbs(&file_data->submitted_in);
-	dev_dbg(dev, "%s: after kill\n", __func__);
-	usb_scuttle_anchored_urbs(&file_data->in_anchor);
-	file_data->in_urbs_used = 0;
-	file_data->in_status = 0; /* no spinlock needed here */
-	dev_dbg(dev, "%s: done=%u ret=%d\n", __func__, done, retval);
+		usb_anchor_urb(urb, &file_data->submitted_out);
+		retval = usb_submit_urb(urb, GFP_KERNEL);
+		if (unlikely(retval))
+			goto error;
 
-	return retval;
-}
+		remaining -= this_part;
+		done += this_part;
+	}
 
-struct compat_message {
-	__u32 transfer_size;
-	__u32 transferred;
-	__u32 flags;
-	__u32 message  __attribute__ ((aligned (8)));
-} __attribute__ ((packed));
+	/* All urbs are on the fly */
+	if (!(flags & USBTMC_FLAG_ASYNC)) {
+		if (!wait_event_interruptible_timeout(file_data->data->waitq,
+						      usb_anchor_empty(&file_data->submitted_out),
+						      expire)) {
+			retval = -ETIMEDOUT;
+			goto error;
+		}
+	}
 
-static ssize_t usbtmc_ioctl_generic_read(struct usbtmc_file_data *file_data,
-					 void __user *arg)
-{
-	struct usbtmc_message msg;
-	struct compat_message *m = (struct compat_message *)&msg;
-	ssize_t retval = 0;
+	retval = 0;
+	goto exit;
 
-	/* mutex already locked */
+error:
+	/* move urbs from submitted_out anchor onto stash list */
+	usbtmc_recover_out_urbs(file_data);
+exit:
+	spin_lock_irq(&file_data->err_lock);
+	if (!(flags & USBTMC_FLAG_ASYNC))
+		done = file_data->out_transfer_size;
+	if (!retval && file_data->out_status)
+		retval = file_data->out_status;
+	spin_unlock_irq(&file_data->err_lock);
 
-	if (copy_from_user(&msg, arg, sizeof(struct usbtmc_message)))
-		return -EFAULT;
+	*transferred = done;
 
-	if (in_compat_syscall())
-		msg.message = compat_ptr((compat_uptr_t)m->message);
+	if (!(flags & USBTMC_FLAG_ASYNC) && usbtmc_over_budget(data))
+		__usbtmc_release_out_urbs(file_data);
 
-	retval = usbtmc_generic_read(file_data, msg.message,
-				     msg.transfer_size, &msg.transferred,
-				     msg.flags);
+	usbtmc_adapt_depth(file_data, &file_data->out_depth, "out");
 
-	if (put_user(msg.transferred,
-		     &((struct usbtmc_message __user *)arg)->transferred))
-		return -EFAULT;
+	dev_dbg(dev, "%s: done=%u, retval=%d, urbstat=%d\n",
+		__func__, done, retval, file_data->out_status);
 
 	return retval;
 }
 
-static void usbtmc_write_bulk_cb(struct urb *urb)
+static void usbtmc_zc_write_cb(struct urb *urb)
 {
 	struct usbtmc_file_data *file_data = urb->context;
-	int wakeup = 0;
-	unsigned long flags, stashed_flags;
+	unsigned long flags;
 
 	spin_lock_irqsave(&file_data->err_lock, flags);
 	file_data->out_transfer_size += urb->actual_length;
@@ -1184,72 +3061,152 @@ static void usbtmc_write_bulk_cb(struct urb *urb)
 				"%s - nonzero write bulk status received: %d\n",
 				__func__, urb->status);
 
-		if (!file_data->out_status) {
+		if (!file_data->out_status)
 			file_data->out_status = urb->status;
-			wakeup = 1;
-		}
-	} else {
-		usb_get_urb(urb);
-		spin_lock_irqsave(&file_data->stashed_urbs.lock, stashed_flags);
-		list_add(&urb->urb_list, &file_data->stashed_urbs.urb_list);
-		spin_unlock_irqrestore(&file_data->stashed_urbs.lock, stashed_flags);
-		wake_up_interruptible(&file_data->stashed_urbs.waitq);
 	}
 	spin_unlock_irqrestore(&file_data->err_lock, flags);
 
-	dev_dbg(&file_data->data->intf->dev,
-		"%s - urb bufsize %u write bulk total size: %u\n",
-		__func__, urb->transfer_buffer_length, file_data->out_transfer_size);
+	/* dma is unmapped before completion */
+	kfree(urb->sg);
+	urb->sg = NULL;
+	urb->num_sgs = 0;
 
-	if (usb_anchor_empty(&file_data->submitted_out) || wakeup)
-		wake_up_interruptible(&file_data->data->waitq);
+	atomic_dec(&file_data->zc_out_in_flight);
+	wake_up_interruptible(&file_data->data->waitq);
+	usbtmc_wake_poll(file_data, EPOLLOUT | EPOLLWRNORM | EPOLLERR);
 }
 
-static ssize_t usbtmc_generic_write(struct usbtmc_file_data *file_data,
-				    const void __user *user_buffer,
-				    u32 transfer_size,
-				    u32 *transferred,
-				    u32 flags)
+static bool usbtmc_zc_write_possible(struct usbtmc_file_data *file_data,
+				     const void __user *user_buffer,
+				     u32 transfer_size, u32 flags)
+{
+	struct usb_bus *bus = file_data->data->usb_dev->bus;
+	size_t pinned;
+
+	if (flags & USBTMC_FLAG_ASYNC)
+		return false;
+
+	/* small writes are cheaper to copy */
+	if (transfer_size < USBTMC_ZC_WRITE_MIN)
+		return false;
+
+	/*
+	 * The pinned pages count against urb_memory_limit. Over budget the
+	 * copy path sends the data with the urbs the handle may still use.
+	 */
+	pinned = PAGE_ALIGN(offset_in_page(user_buffer) + (size_t)transfer_size);
+	if (pinned > LONG_MAX || !usbtmc_budget_ok(file_data, pinned))
+		return false;
+
+	if (bus->sg_tablesize < 2)
+		return false;
+
+	/* all sg elements but the last must be full packets otherwise */
+	if (!bus->no_sg_constraint && offset_in_page(user_buffer))
+		return false;
+
+	return true;
+}
+
+/* Describe len bytes at byte offset pos of the pinned pages */
+static int usbtmc_zc_fill_sg(struct scatterlist *sg, struct page **pages,
+			     int pinned, size_t pos, u32 len)
+{
+	int n = 0;
+
+	sg_init_table(sg, USBTMC_ZC_URB_PAGES + 1);
+	while (len) {
+		unsigned int offset = pos & ~PAGE_MASK;
+		unsigned int this_part = min_t(u32, len, PAGE_SIZE - offset);
+
+		if (WARN_ON_ONCE(pos >> PAGE_SHIFT >= pinned ||
+				 n > USBTMC_ZC_URB_PAGES))
+			return -EFAULT;
+
+		sg_set_page(&sg[n++], pages[pos >> PAGE_SHIFT],
+			    this_part, offset);
+		pos += this_part;
+		len -= this_part;
+	}
+	sg_mark_end(&sg[n - 1]);
+
+	return n;
+}
+
+/*
+ * Zero copy variant of the generic write for large synchronous writes.
+ * The user pages are pinned and sent with scatter-gather urbs, keeping
+ * up to out_depth.max urbs in flight.
+ */
+static ssize_t usbtmc_zc_write(struct usbtmc_file_data *file_data,
+			       const void __user *user_buffer,
+			       u32 transfer_size,
+			       u32 *transferred,
+			       u32 flags)
 {
 	struct usbtmc_device_data *data = file_data->data;
 	struct device *dev = &data->intf->dev;
+	unsigned long start = (unsigned long)user_buffer;
+	u32 offset = offset_in_page(start);
+	unsigned int nr_sgs = min_t(unsigned int,
+				    data->usb_dev->bus->sg_tablesize,
+				    USBTMC_ZC_URB_PAGES + 1);
+	/* an unaligned urb may straddle one more page */
+	const u32 urb_size = (nr_sgs - 1) * PAGE_SIZE;
+	unsigned long expire = msecs_to_jiffies(file_data->timeout);
+	struct page **pages;
+	u32 pos = 0;
 	u32 done = 0;
-	u32 remaining;
-	unsigned long expire;
-	const u32 bufsize = data->bout_bsiz;
-	struct urb *urb = NULL;
+	int nr_pages;
+	int pinned;
+	long wait_rv;
 	int retval = 0;
-	u32 timeout;
 
 	*transferred = 0;
 
-	dev_dbg(dev, "%s: size=%u flags=0x%X used=%u\n",
-		__func__, transfer_size, flags,
-		file_data->out_urbs_used);
+	/* as in the copy path, no u32 wrap of offset + transfer_size */
+	if (transfer_size > INT_MAX)
+		transfer_size = INT_MAX;
+	nr_pages = DIV_ROUND_UP((size_t)offset + transfer_size, PAGE_SIZE);
+
+	pages = kvmalloc_array(nr_pages, sizeof(*pages), GFP_KERNEL);
+	if (!pages)
+		return -ENOMEM;
+
+	pinned = pin_user_pages_fast(start & PAGE_MASK, nr_pages, 0, pages);
+	if (pinned != nr_pages) {
+		retval = (pinned < 0) ? pinned : -EFAULT;
+		goto unpin;
+	}
+	usbtmc_charge(file_data, (long)nr_pages << PAGE_SHIFT);
 
+	spin_lock_irq(&file_data->err_lock);
 	if (flags & USBTMC_FLAG_APPEND) {
-		spin_lock_irq(&file_data->err_lock);
 		retval = file_data->out_status;
-		spin_unlock_irq(&file_data->err_lock);
-		if (retval < 0)
-			return retval;
 	} else {
-		spin_lock_irq(&file_data->err_lock);
 		file_data->out_transfer_size = 0;
 		file_data->out_status = 0;
-		spin_unlock_irq(&file_data->err_lock);
 	}
+	spin_unlock_irq(&file_data->err_lock);
+	if (retval < 0)
+		goto uncharge;
 
-	remaining = transfer_size;
-	if (remaining > INT_MAX)
-		remaining = INT_MAX;
+	dev_dbg(dev, "%s: size=%u pages=%d urb_size=%u\n",
+		__func__, transfer_size, nr_pages, urb_size);
 
-	timeout = file_data->timeout;
-	expire = msecs_to_jiffies(timeout);
+	while (pos < transfer_size) {
+		u32 this_part = min(transfer_size - pos, urb_size);
+		struct scatterlist *sg;
+		struct urb *urb;
 
-	while (remaining > 0) {
-		u32 this_part, aligned;
-		u8 *buffer = NULL;
+		wait_rv = wait_event_interruptible_timeout(data->waitq,
+			atomic_read(&file_data->zc_out_in_flight) <
+				file_data->out_depth.max,
+			expire);
+		if (wait_rv <= 0) {
+			retval = wait_rv ? wait_rv : -ETIMEDOUT;
+			goto error;
+		}
 
 		spin_lock_irq(&file_data->err_lock);
 		retval = file_data->out_status;
@@ -1257,92 +3214,273 @@ static ssize_t usbtmc_generic_write(struct usbtmc_file_data *file_data,
 		if (retval < 0)
 			goto error;
 
-		/* prepare next urb to send */
-		retval = usbtmc_new_out_urb(file_data, &urb, flags);
-		if (retval)
-			goto error;
-
+		urb = usb_alloc_urb(0, GFP_KERNEL);
 		if (!urb) {
-			if (flags & USBTMC_FLAG_ASYNC) {
-				retval = (done)?(0):(-EAGAIN);
-				goto exit;
-			} else {
-				retval = -ENOENT;
-				goto error;
-			}
+			retval = -ENOMEM;
+			goto error;
 		}
 
-		buffer = urb->transfer_buffer;
-
-		if (remaining > bufsize)
-			this_part = bufsize;
-		else
-			this_part = remaining;
-
-		if (copy_from_user(buffer, user_buffer + done, this_part)) {
-			retval = -EFAULT;
-			usb_anchor_urb(urb, &file_data->submitted_out);
+		sg = kmalloc_array(USBTMC_ZC_URB_PAGES + 1, sizeof(*sg),
+				   GFP_KERNEL);
+		if (!sg) {
+			usb_free_urb(urb);
+			retval = -ENOMEM;
 			goto error;
 		}
 
-		print_hex_dump_debug("usbtmc ", DUMP_PREFIX_NONE,
-			16, 1, buffer, this_part, true);
-
-		/* fill bulk with 32 bit alignment to meet USBTMC specification
-		 * (size + 3 & ~3) rounds up and simplifies user code
-		 */
-		aligned = (this_part + 3) & ~3;
-		dev_dbg(dev, "write(size:%u align:%u done:%u)\n",
-			(unsigned int)this_part,
-			(unsigned int)aligned,
-			(unsigned int)done);
-
 		usb_fill_bulk_urb(urb, data->usb_dev,
 			usb_sndbulkpipe(data->usb_dev, data->bulk_out),
-			urb->transfer_buffer, aligned,
-			usbtmc_write_bulk_cb, file_data);
+			NULL, this_part, usbtmc_zc_write_cb, file_data);
+		retval = usbtmc_zc_fill_sg(sg, pages, pinned,
+					   (size_t)offset + pos, this_part);
+		if (retval < 0) {
+			kfree(sg);
+			usb_free_urb(urb);
+			goto error;
+		}
+		urb->sg = sg;
+		urb->num_sgs = retval;
 
-		usb_anchor_urb(urb, &file_data->submitted_out);
+		atomic_inc(&file_data->zc_out_in_flight);
+		usb_anchor_urb(urb, &file_data->submitted_zc);
 		retval = usb_submit_urb(urb, GFP_KERNEL);
-		if (unlikely(retval))
+		if (unlikely(retval)) {
+			usb_unanchor_urb(urb);
+			atomic_dec(&file_data->zc_out_in_flight);
+			kfree(sg);
+			usb_free_urb(urb);
 			goto error;
+		}
+		/* urb is anchored. We can release our reference. */
+		usb_free_urb(urb);
 
-		remaining -= this_part;
-		done += this_part;
+		pos += this_part;
 	}
 
-	/* All urbs are on the fly */
-	if (!(flags & USBTMC_FLAG_ASYNC)) {
-		if (!wait_event_interruptible_timeout(file_data->data->waitq,
-						      usb_anchor_empty(&file_data->submitted_out),
-						      expire)) {
-			retval = -ETIMEDOUT;
-			goto error;
-		}
+	/* the pages stay pinned until all urbs are done */
+	wait_rv = wait_event_interruptible_timeout(data->waitq,
+		usb_anchor_empty(&file_data->submitted_zc) &&
+		usb_anchor_empty(&file_data->submitted_out),
+		expire);
+	if (wait_rv <= 0) {
+		retval = wait_rv ? wait_rv : -ETIMEDOUT;
+		goto error;
 	}
 
 	retval = 0;
 	goto exit;
 
 error:
-	/* move urbs from submitted_out anchor onto stash list */
+	usb_kill_anchored_urbs(&file_data->submitted_zc);
+	/* header urb of usbtmc_write() */
 	usbtmc_recover_out_urbs(file_data);
 exit:
 	spin_lock_irq(&file_data->err_lock);
-	if (!(flags & USBTMC_FLAG_ASYNC))
-		done = file_data->out_transfer_size;
+	done = file_data->out_transfer_size;
 	if (!retval && file_data->out_status)
 		retval = file_data->out_status;
 	spin_unlock_irq(&file_data->err_lock);
 
 	*transferred = done;
 
-	dev_dbg(dev, "%s: done=%u, retval=%d, urbstat=%d\n",
-		__func__, done, retval, file_data->out_status);
+	dev_dbg(dev, "%s: done=%u, retval=%d\n", __func__, done, retval);
+uncharge:
+	usbtmc_charge(file_data, -((long)nr_pages << PAGE_SHIFT));
+unpin:
+	if (pinned > 0)
+		unpin_user_pages(pages, pinned);
+	kvfree(pages);
+	return retval;
+}
+
+static ssize_t usbtmc_generic_write(struct usbtmc_file_data *file_data,
+				    const void __user *user_buffer,
+				    u32 transfer_size,
+				    u32 *transferred,
+				    u32 flags)
+{
+	struct iovec iov;
+	struct iov_iter from;
+	int retval;
+
+	if (transfer_size > INT_MAX)
+		transfer_size = INT_MAX;
+
+	if (usbtmc_zc_write_possible(file_data, user_buffer, transfer_size,
+				     flags)) {
+		u32 zc_size = transfer_size;
+
+		/* the end of the transfer needs padding: copy the last page */
+		if (transfer_size & 3)
+			zc_size = round_down(transfer_size - 1, PAGE_SIZE);
+
+		retval = usbtmc_zc_write(file_data, user_buffer, zc_size,
+					 transferred, flags);
+		if (retval < 0 || zc_size == transfer_size)
+			return retval;
+
+		user_buffer += zc_size;
+		transfer_size -= zc_size;
+		flags |= USBTMC_FLAG_APPEND;
+	}
+
+	retval = usbtmc_import_ubuf(WRITE, (void __user *)user_buffer,
+				    transfer_size, &iov, &from);
+	if (retval < 0) {
+		*transferred = 0;
+		return retval;
+	}
+
+	return __usbtmc_generic_write(file_data, &from, transfer_size,
+				      transferred, flags);
+}
+
+static int __usbtmc_read_message(struct usbtmc_file_data *file_data,
+				 struct iov_iter *to, u32 count,
+				 u32 *transferred, bool block);
+static int __usbtmc_write_message(struct usbtmc_file_data *file_data,
+				  struct iov_iter *from,
+				  const u8 __user *buf, u32 count, bool eom,
+				  u32 *transferred);
+
+/*
+ * read_iter/write_iter: the same USBTMC messages as read() and write(),
+ * for readv/writev, AIO and splice.
+ */
+static ssize_t usbtmc_iter_io(struct kiocb *iocb, struct iov_iter *iter,
+			      bool read)
+{
+	struct usbtmc_file_data *file_data = iocb->ki_filp->private_data;
+	struct usbtmc_device_data *data = file_data->data;
+	enum usbtmc_txn_hold hold = USBTMC_TXN_RELEASE;
+	size_t size = iov_iter_count(iter);
+	u32 count = min_t(size_t, size, INT_MAX);
+	u32 done = 0;
+	ssize_t retval;
+
+	retval = usbtmc_txn_begin(file_data, read || file_data->out_msg_open);
+	if (retval < 0)
+		return retval;
+
+	retval = mutex_lock_interruptible(&data->io_mutex);
+	if (retval < 0)
+		goto end_txn;
 
+	if (data->zombie) {
+		retval = -ENODEV;
+		goto exit;
+	}
+
+	if (read) {
+		retval = __usbtmc_read_message(file_data, iter, count, &done,
+					       false);
+		if (retval < 0)
+			goto exit;
+		/* the rest of the response is read by the next call */
+		hold = usbtmc_read_hold(file_data);
+		/* Update file position value, as usbtmc_read() */
+		iocb->ki_pos += done;
+	} else {
+		/* as write(): the rest of a huge buffer continues the message */
+		retval = __usbtmc_write_message(file_data, iter, NULL, count,
+						size <= INT_MAX, &done);
+		if (retval < 0)
+			goto exit;
+		hold = usbtmc_write_hold(file_data);
+	}
+
+	retval = done;
+exit:
+	mutex_unlock(&data->io_mutex);
+end_txn:
+	usbtmc_txn_end(file_data, hold);
 	return retval;
 }
 
+/* An async iocb, completed from data->aio_wq */
+struct usbtmc_aio {
+	struct work_struct work;
+	struct kiocb *iocb;
+	struct usbtmc_file_data *file_data;
+	struct mm_struct *mm;
+	struct iov_iter iter;
+	const void *iov;	/* copy of the iovec array, may be NULL */
+	bool read;
+};
+
+static void usbtmc_aio_work(struct work_struct *work)
+{
+	struct usbtmc_aio *aio = container_of(work, struct usbtmc_aio, work);
+	ssize_t retval;
+
+	/* the iocb holds a reference to the file and thus to file_data */
+	kthread_use_mm(aio->mm);
+	retval = usbtmc_iter_io(aio->iocb, &aio->iter, aio->read);
+	kthread_unuse_mm(aio->mm);
+	mmput(aio->mm);
+
+	dev_dbg(&aio->file_data->data->intf->dev, "%s: %s ret=%zd\n",
+		__func__, aio->read ? "read" : "write", retval);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+	aio->iocb->ki_complete(aio->iocb, retval);
+#else
+	aio->iocb->ki_complete(aio->iocb, retval, 0);
+#endif
+	kfree(aio->iov);
+	kfree(aio);
+}
+
+static ssize_t usbtmc_aio_submit(struct kiocb *iocb, struct iov_iter *iter,
+				 bool read)
+{
+	struct usbtmc_file_data *file_data = iocb->ki_filp->private_data;
+	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_aio *aio;
+
+	if (data->zombie)
+		return -ENODEV;
+
+	aio = kzalloc(sizeof(*aio), GFP_KERNEL);
+	if (!aio)
+		return -ENOMEM;
+
+	/* the caller's iterator does not survive the return */
+	aio->iov = dup_iter(&aio->iter, iter, GFP_KERNEL);
+	if (!aio->iov && !usbtmc_iter_is_ubuf(iter)) {
+		kfree(aio);
+		return -ENOMEM;
+	}
+
+	INIT_WORK(&aio->work, usbtmc_aio_work);
+	aio->iocb = iocb;
+	aio->file_data = file_data;
+	aio->read = read;
+	aio->mm = current->mm;
+	mmget(aio->mm);
+
+	/* ordered queue: iocbs of one device complete in submission order */
+	queue_work(data->aio_wq, &aio->work);
+
+	return -EIOCBQUEUED;
+}
+
+static ssize_t usbtmc_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	if (!is_sync_kiocb(iocb))
+		return usbtmc_aio_submit(iocb, to, true);
+
+	return usbtmc_iter_io(iocb, to, true);
+}
+
+static ssize_t usbtmc_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	if (!is_sync_kiocb(iocb))
+		return usbtmc_aio_submit(iocb, from, false);
+
+	return usbtmc_iter_io(iocb, from, false);
+}
+
 static ssize_t usbtmc_ioctl_generic_write(struct usbtmc_file_data *file_data,
 					  void __user *arg)
 {
@@ -1503,37 +3641,148 @@ static int usbtmc488_ioctl_trigger(struct usbtmc_file_data *file_data)
 	return 0;
 }
 
-static ssize_t usbtmc_read(struct file *filp, char __user *buf,
-			   size_t count, loff_t *f_pos)
+/*
+ * Parses an IEEE 488.2 definite length block header #<n><length>.
+ * Returns the size of the header or a negative error.
+ */
+static int usbtmc_parse_block_header(const u8 *buffer, u32 size, u32 *length)
+{
+	u32 ndigits;
+	u32 i;
+
+	if (size < 2 || buffer[0] != '#')
+		return -EBADMSG;
+
+	/* #0 (indefinite length) is not supported */
+	if (buffer[1] < '1' || buffer[1] > '9')
+		return -EBADMSG;
+
+	ndigits = buffer[1] - '0';
+	if (size < 2 + ndigits)
+		return -EBADMSG;
+
+	*length = 0;
+	for (i = 0; i < ndigits; i++) {
+		u8 c = buffer[2 + i];
+
+		if (c < '0' || c > '9')
+			return -EBADMSG;
+		*length = *length * 10 + (c - '0');
+	}
+
+	return 2 + ndigits;
+}
+
+/*
+ * Chooses the bulk in urbs armed before a REQUEST_DEV_DEP_MSG_IN from
+ * the sizes of the last responses. When they all fit in one packet the
+ * first urb is a single packet. Otherwise as many urbs are posted ahead
+ * as the smallest recent response needs, so a handle that keeps reading
+ * waveforms does not wait for the header before posting more, while a
+ * handle mixing queries and waveforms does not over-post.
+ */
+static void usbtmc_plan_in_urbs(struct usbtmc_file_data *file_data,
+				u32 *first_size, u32 *first_urbs)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	const u32 bufsize = file_data->bin_bsiz;
+	u32 lo = U32_MAX;
+	u32 hi = 0;
+	u32 i;
+
+	*first_size = bufsize;
+	*first_urbs = 1;
+
+	if (!file_data->adaptive_in || !file_data->in_hist_len)
+		return;
+
+	for (i = 0; i < file_data->in_hist_len; i++) {
+		lo = min(lo, file_data->in_hist[i]);
+		hi = max(hi, file_data->in_hist[i]);
+	}
+
+	if (hi + USBTMC_HEADER_SIZE <= data->bin_maxp) {
+		*first_size = data->bin_maxp;
+		return;
+	}
+
+	*first_urbs =
+		clamp_t(u32, DIV_ROUND_UP(lo + USBTMC_HEADER_SIZE, bufsize),
+			1, file_data->in_depth.max);
+}
+
+static void usbtmc_record_in_size(struct usbtmc_file_data *file_data,
+				  u32 n_characters)
+{
+	file_data->in_hist[file_data->in_hist_pos] = n_characters;
+	file_data->in_hist_pos = (file_data->in_hist_pos + 1) % USBTMC_IN_HIST;
+	if (file_data->in_hist_len < USBTMC_IN_HIST)
+		file_data->in_hist_len++;
+}
+
+/* Kills the bulk in urbs posted ahead of the header by usbtmc_plan_in_urbs() */
+static void usbtmc_drop_in_urbs(struct usbtmc_file_data *file_data)
+{
+	if (!file_data->in_urbs_used)
+		return;
+
+	usb_kill_anchored_urbs(&file_data->submitted_in);
+	usbtmc_recover_in_urbs(file_data);
+	file_data->in_urbs_used = 0;
+}
+
+/*
+ * Requests a DEV_DEP_MSG_IN transfer of up to count bytes and copies
+ * the message to the iterator.
+ *
+ * In block mode the response must start with an IEEE 488.2 definite
+ * length block and only the block data are copied. Anything following
+ * the block in the transfer (e.g. the terminating newline) is dropped.
+ * *block_missing returns the bytes of the block that were not part of
+ * this transfer.
+ */
+static int usbtmc_read_transfer(struct usbtmc_file_data *file_data,
+				struct iov_iter *to, u32 count,
+				u32 *transferred, bool block,
+				u32 *block_missing)
 {
-	struct usbtmc_file_data *file_data = filp->private_data;
 	struct usbtmc_device_data *data = file_data->data;
 	struct device *dev = &data->intf->dev;
 	struct urb *urb;
-	const u32 bufsize = (u32)data->bin_bsiz;
+	u32 bufsize;
+	u32 first_urbs;
 	u8 in_header[USBTMC_HEADER_SIZE];
 	u32 n_characters;
 	u8 *buffer;
 	int actual = 0;
 	u32 done = 0;
 	u32 remaining;
+	u32 request_size;
+	u32 block_size = 0;
+	u32 first;
+	int skip = 0;
 	int retval;
 	unsigned long expire;
 	long wait_rv;
+	ktime_t armed;
 
-	retval = mutex_lock_interruptible(&data->io_mutex);
-	if (retval < 0)
-		goto exit_nolock;
+	/* mutex already locked */
 
-	if (data->zombie) {
-		retval = -ENODEV;
-		goto exit;
-	}
+	*transferred = 0;
+
+	if ((file_data->ring && file_data->ring->active) ||
+	    file_data->in_streaming)
+		return -EBUSY;
 
 	if (count > INT_MAX)
 		count = INT_MAX;
 
-	dev_dbg(dev, "%s(count:%zu)\n", __func__, count);
+	/* leave room for the block header and the terminator */
+	request_size = count;
+	if (block)
+		request_size = min_t(u32, count + USBTMC_BLOCK_SLACK, INT_MAX);
+
+	dev_dbg(dev, "%s(count:%u block:%d)\n", __func__, count, block);
 
 	/* Setup IO buffer for REQUEST_DEV_DEP_MSG_IN message
 	 * Refer to class specs for details
@@ -1543,38 +3792,32 @@ static ssize_t usbtmc_read(struct file *filp, char __user *buf,
 	in_header[1] = data->bTag;
 	in_header[2] = ~data->bTag;
 	in_header[3] = 0; /* Reserved */
-	in_header[4] = count >> 0;
-	in_header[5] = count >> 8;
-	in_header[6] = count >> 16;
-	in_header[7] = count >> 24;
+	in_header[4] = request_size >> 0;
+	in_header[5] = request_size >> 8;
+	in_header[6] = request_size >> 16;
+	in_header[7] = request_size >> 24;
 	in_header[8] = file_data->term_char_enabled * 2;
 	/* Use term character? */
 	in_header[9] = file_data->term_char;
 	in_header[10] = 0; /* Reserved */
 	in_header[11] = 0; /* Reserved */
 
-	retval = send_bulk_out_header(file_data, in_header);
-
-	if (retval < 0) {
-		usbtmc_ioctl_abort_bulk_out(data);
-		goto exit;
-	}
-
-	remaining = count;
-	actual = 0;
-
 	spin_lock_irq(&file_data->err_lock);
 	file_data->in_transfer_size = 0;
 	file_data->in_status = 0;
 	spin_unlock_irq(&file_data->err_lock);
 
-	urb = usbtmc_create_urb(bufsize);
+	/* Arm the bulk in endpoint before sending the request so that the
+	 * response does not wait for the completion of the header urb.
+	 */
+	usbtmc_plan_in_urbs(file_data, &bufsize, &first_urbs);
+
+	urb = usbtmc_new_in_urb(file_data);
 	if (!urb) {
 		retval = -ENOMEM;
 		goto exit;
 	}
 
-
 	buffer = urb->transfer_buffer;
 
 	usb_fill_bulk_urb(urb, data->usb_dev,
@@ -1583,12 +3826,39 @@ static ssize_t usbtmc_read(struct file *filp, char __user *buf,
 
 	usb_anchor_urb(urb, &file_data->submitted_in);
 	retval = usb_submit_urb(urb, GFP_KERNEL);
-	usb_free_urb(urb);
 	if (unlikely(retval)) {
 		usb_unanchor_urb(urb);
+		usbtmc_return_in_urb(file_data, urb);
+		goto exit;
+	}
+	usb_free_urb(urb);
+
+	/* the urbs after the first one are counted in in_urbs_used */
+	retval = usbtmc_submit_in_urbs(file_data, first_urbs - 1);
+	if (retval) {
+		usb_kill_anchored_urbs(&file_data->submitted_in);
+		usbtmc_recover_in_urbs(file_data);
+		file_data->in_urbs_used = 0;
+		goto exit;
+	}
+	armed = ktime_get();
+
+	retval = send_bulk_out_header(file_data, in_header);
+
+	if (retval < 0) {
+		usb_kill_anchored_urbs(&file_data->submitted_in);
+		usbtmc_recover_in_urbs(file_data);
+		usbtmc_ioctl_abort_bulk_out(data);
 		goto exit;
 	}
 
+	/* time the bulk in urb was posted ahead of the old sequence */
+	dev_dbg(dev, "%s: bulk in armed %lld us before header completion\n",
+		__func__, ktime_us_delta(ktime_get(), armed));
+
+	remaining = request_size;
+	actual = 0;
+
 	expire = msecs_to_jiffies(file_data->timeout);
 	wait_rv = wait_event_interruptible_timeout(file_data->wait_bulk_in,
 						   usbtmc_do_transfer(file_data),
@@ -1605,6 +3875,7 @@ static ssize_t usbtmc_read(struct file *filp, char __user *buf,
 	}
 
 	if (file_data->in_status) {
+		usbtmc_drop_in_urbs(file_data);
 		usbtmc_ioctl_abort_bulk_in(data);
 		retval = file_data->in_status;
 		goto error;
@@ -1619,7 +3890,8 @@ static ssize_t usbtmc_read(struct file *filp, char __user *buf,
 	/* Store bTag (in case we need to abort) */
 	data->bTag_last_read = data->bTag;
 
-	actual = file_data->in_transfer_size;
+	/* urbs posted ahead may have completed as well */
+	actual = urb->actual_length;
 	dev_dbg(dev, "%s: bulk msg in retval(%u), actual(%d)\n",
 		__func__, retval, actual);
 
@@ -1627,16 +3899,18 @@ static ssize_t usbtmc_read(struct file *filp, char __user *buf,
 	if (actual < USBTMC_HEADER_SIZE) {
 		dev_err(dev, "Device sent too small first packet: %u < %u\n",
 			actual, USBTMC_HEADER_SIZE);
+		usbtmc_drop_in_urbs(file_data);
 		usbtmc_ioctl_abort_bulk_in(data);
-		usb_free_urb(urb);
+		usbtmc_return_in_urb(file_data, urb);
 		retval = -EIO;
 		goto exit;
 	}
 
 	if (buffer[0] != 2) {
 		dev_err(dev, "Device sent reply with wrong MsgID: %u != 2\n", buffer[0]);
+		usbtmc_drop_in_urbs(file_data);
 		usbtmc_ioctl_abort_bulk_in(data);
-		usb_free_urb(urb);
+		usbtmc_return_in_urb(file_data, urb);
 		retval = -EIO;
 		goto exit;
 	}
@@ -1644,8 +3918,9 @@ static ssize_t usbtmc_read(struct file *filp, char __user *buf,
 	if (buffer[1] != data->bTag_last_write) {
 		dev_err(dev, "Device sent reply with wrong bTag: %u != %u\n",
 			buffer[1], data->bTag_last_write);
+		usbtmc_drop_in_urbs(file_data);
 		usbtmc_ioctl_abort_bulk_in(data);
-		usb_free_urb(urb);
+		usbtmc_return_in_urb(file_data, urb);
 		retval = -EIO;
 		goto exit;
 	}
@@ -1662,18 +3937,42 @@ static ssize_t usbtmc_read(struct file *filp, char __user *buf,
 		__func__, n_characters, buffer[8]);
 
 	if (n_characters > remaining) {
-		dev_err(dev, "Device wants to return more data than requested: %u > %zu\n",
-			n_characters, count);
+		dev_err(dev, "Device wants to return more data than requested: %u > %u\n",
+			n_characters, request_size);
+		usbtmc_drop_in_urbs(file_data);
 		usbtmc_ioctl_abort_bulk_in(data);
-		usb_free_urb(urb);
+		usbtmc_return_in_urb(file_data, urb);
 		retval = -EIO;
 		goto exit;
 	}
 
 	print_hex_dump_debug("usbtmc ", DUMP_PREFIX_NONE, 16, 1, buffer, actual, true);
 
+	usbtmc_record_in_size(file_data, n_characters);
 	remaining = n_characters;
 
+	/* The header tells the size of the whole payload: post the urbs for
+	 * the rest of it now, before the first buffer is copied to user
+	 * space, instead of leaving the endpoint idle until generic_read.
+	 * This is the number of urbs generic_read computes with
+	 * USBTMC_FLAG_IGNORE_TRAILER for the same size.
+	 */
+	if (actual == bufsize &&
+	    n_characters > bufsize - USBTMC_HEADER_SIZE) {
+		u32 rest = n_characters - (bufsize - USBTMC_HEADER_SIZE);
+		int nurbs = min_t(u32, rest / file_data->bin_bsiz + 1,
+				  file_data->in_depth.max);
+
+		nurbs = max(nurbs - file_data->in_urbs_used, 0);
+		retval = usbtmc_submit_in_urbs(file_data, nurbs);
+		if (retval) {
+			usbtmc_return_in_urb(file_data, urb);
+			goto error;
+		}
+		dev_dbg(dev, "%s: posted %d urbs for %u bytes\n",
+			__func__, nurbs, rest);
+	}
+
 	/* Remove the USBTMC header */
 	actual -= USBTMC_HEADER_SIZE;
 
@@ -1683,61 +3982,254 @@ static ssize_t usbtmc_read(struct file *filp, char __user *buf,
 
 	remaining -= actual;
 
+	if (block) {
+		skip = usbtmc_parse_block_header(&buffer[USBTMC_HEADER_SIZE],
+						 actual, &block_size);
+		if (skip < 0) {
+			dev_dbg(dev, "%s: no definite length block header\n",
+				__func__);
+			retval = skip;
+			goto abort;
+		}
+
+		if (block_size > count) {
+			dev_dbg(dev, "%s: block of %u bytes exceeds buffer of %u\n",
+				__func__, block_size, count);
+			retval = -EMSGSIZE;
+			goto abort;
+		}
+
+		/* the rest follows in the next transfers of the message */
+		if (block_size > n_characters - skip) {
+			*block_missing = block_size - (n_characters - skip);
+			block_size = n_characters - skip;
+		}
+
+		dev_dbg(dev, "%s: block header %d bytes, length %u\n",
+			__func__, skip, block_size);
+	}
+
 	/* Copy buffer to user space */
-	if (copy_to_user(buf, &buffer[USBTMC_HEADER_SIZE], actual)) {
+	first = block ? min_t(u32, actual - skip, block_size) : actual;
+	if (copy_to_iter(&buffer[USBTMC_HEADER_SIZE + skip], first,
+			 to) != first) {
 		/* There must have been an addressing problem */
-		usb_free_urb(urb);
+		usbtmc_return_in_urb(file_data, urb);
 		retval = -EFAULT;
-		goto exit;
+		goto error;
 	}
 
-	usb_free_urb(urb);
+	usbtmc_return_in_urb(file_data, urb);
 
 	if ((actual + USBTMC_HEADER_SIZE) == bufsize) {
-		retval = usbtmc_generic_read(file_data, buf + actual,
-					     remaining,
-					     &done,
-					     USBTMC_FLAG_IGNORE_TRAILER);
+		/* receive the rest of the transfer, copy the block or message */
+		retval = __usbtmc_generic_read(file_data, to,
+					       block ? block_size - first :
+					       remaining,
+					       remaining, &done,
+					       USBTMC_FLAG_IGNORE_TRAILER);
 		if (retval < 0)
 			goto exit;
 	}
-	done += actual;
 
-	/* Update file position value */
-	*f_pos = *f_pos + done;
-	retval = done;
+	if (block)
+		done = min(done + actual - skip, block_size);
+	else
+		done += actual;
+
+	*transferred = done;
+	retval = 0;
+	goto exit;
+abort:
+	/* discard the rest of the response */
+	usbtmc_return_in_urb(file_data, urb);
+	usb_kill_anchored_urbs(&file_data->submitted_in);
+	usbtmc_recover_in_urbs(file_data);
+	file_data->in_urbs_used = 0;
+	usbtmc_ioctl_abort_bulk_in(data);
 	goto exit;
 error:
 	usb_kill_anchored_urbs(&file_data->submitted_in);
-	usb_scuttle_anchored_urbs(&file_data->in_anchor);
+	usbtmc_recover_in_urbs(file_data);
+	file_data->in_urbs_used = 0;
 exit:
+	/* response shorter than planned */
+	usbtmc_drop_in_urbs(file_data);
 	file_data->in_status = 0;
-	mutex_unlock(&data->io_mutex);
-exit_nolock:
 	return retval;
 }
 
-static ssize_t usbtmc_write(struct file *filp, const char __user *buf,
-			    size_t count, loff_t *f_pos)
+/*
+ * Reads one transfer of a message, or with block a complete definite
+ * length block. A device may split the message into several transfers
+ * (no EOM) with the block crossing the end of the first one. Its rest
+ * is then requested with further REQUEST_DEV_DEP_MSG_IN transfers and
+ * a block that ends with the message before it is complete is an
+ * error.
+ */
+static int __usbtmc_read_message(struct usbtmc_file_data *file_data,
+				 struct iov_iter *to, u32 count,
+				 u32 *transferred, bool block)
 {
-	struct usbtmc_file_data *file_data;
-	struct usbtmc_device_data *data;
-	struct urb *urb = NULL;
-	ssize_t retval = 0;
-	u8 *buffer;
-	u32 remaining, done;
-	u32 transfersize, aligned, buflen;
+	struct device *dev = &file_data->data->intf->dev;
+	u8 trailer[USBTMC_BLOCK_SLACK];
+	struct kvec kv = { .iov_base = trailer, .iov_len = sizeof(trailer) };
+	struct iov_iter rest;
+	u32 missing = 0;
+	u32 done;
+	int retval;
 
-	file_data = filp->private_data;
-	data = file_data->data;
+	retval = usbtmc_read_transfer(file_data, to, count, transferred,
+				      block, &missing);
+	if (retval < 0 || !missing)
+		return retval;
 
-	mutex_lock(&data->io_mutex);
+	while (missing) {
+		/* EOM: the message ended inside the block */
+		if (file_data->bmTransferAttributes & 1) {
+			dev_dbg(dev, "%s: block short by %u bytes\n",
+				__func__, missing);
+			return -EBADMSG;
+		}
+
+		retval = usbtmc_read_transfer(file_data, to, missing, &done,
+					      false, NULL);
+		*transferred += done;
+		if (retval < 0)
+			return retval;
+		if (!done) {
+			dev_dbg(dev, "%s: empty transfer, block short by %u bytes\n",
+				__func__, missing);
+			return -EBADMSG;
+		}
+		missing -= done;
+	}
+
+	/* drop the end of the message following the block, as in one transfer */
+	if (!(file_data->bmTransferAttributes & 1)) {
+		iov_iter_kvec(&rest, READ, &kv, 1, sizeof(trailer));
+		retval = usbtmc_read_transfer(file_data, &rest,
+					      sizeof(trailer), &done, false,
+					      NULL);
+	}
+
+	return retval;
+}
+
+static int usbtmc_read_message(struct usbtmc_file_data *file_data,
+			       u8 __user *buf, u32 count,
+			       u32 *transferred, bool block)
+{
+	struct iovec iov;
+	struct iov_iter to;
+	int retval;
+
+	*transferred = 0;
+
+	if (count > INT_MAX)
+		count = INT_MAX;
+
+	retval = usbtmc_import_ubuf(READ, buf, count, &iov, &to);
+	if (retval < 0)
+		return retval;
+
+	return __usbtmc_read_message(file_data, &to, count, transferred,
+				     block);
+}
+
+static ssize_t usbtmc_read(struct file *filp, char __user *buf,
+			   size_t count, loff_t *f_pos)
+{
+	struct usbtmc_file_data *file_data = filp->private_data;
+	struct usbtmc_device_data *data = file_data->data;
+	u32 done = 0;
+	enum usbtmc_txn_hold hold = USBTMC_TXN_RELEASE;
+	int retval;
+
+	retval = usbtmc_txn_begin(file_data, true);
+	if (retval < 0)
+		return retval;
+
+	retval = mutex_lock_interruptible(&data->io_mutex);
+	if (retval < 0)
+		goto end_txn;
 
 	if (data->zombie) {
 		retval = -ENODEV;
 		goto exit;
 	}
 
+	if (count > INT_MAX)
+		count = INT_MAX;
+
+	retval = usbtmc_read_message(file_data, buf, count, &done, false);
+	if (retval < 0)
+		goto exit;
+
+	/* the rest of the response is read by the next call */
+	hold = usbtmc_read_hold(file_data);
+
+	/* Update file position value */
+	*f_pos = *f_pos + done;
+	retval = done;
+exit:
+	mutex_unlock(&data->io_mutex);
+end_txn:
+	usbtmc_txn_end(file_data, hold);
+	return retval;
+}
+
+/*
+ * Reads an IEEE 488.2 definite length block response and returns
+ * only the block data.
+ */
+static ssize_t usbtmc_ioctl_read_block(struct usbtmc_file_data *file_data,
+				       void __user *arg)
+{
+	struct usbtmc_message msg;
+	struct compat_message *m = (struct compat_message *)&msg;
+	ssize_t retval = 0;
+
+	/* mutex already locked */
+
+	if (copy_from_user(&msg, arg, sizeof(struct usbtmc_message)))
+		return -EFAULT;
+
+	if (in_compat_syscall())
+		msg.message = compat_ptr((compat_uptr_t)m->message);
+
+	retval = usbtmc_read_message(file_data, msg.message,
+				     msg.transfer_size, &msg.transferred,
+				     true);
+
+	if (put_user(msg.transferred,
+		     &((struct usbtmc_message __user *)arg)->transferred))
+		return -EFAULT;
+
+	return retval;
+}
+
+/*
+ * Sends count bytes as one DEV_DEP_MSG_OUT transfer. The EOM bit is set
+ * as configured with USBTMC_IOCTL_EOM_ENABLE when eom is true. buf is
+ * the user buffer behind from if there is one, the rest of a large
+ * message is then sent from the pinned user pages.
+ */
+static int __usbtmc_write_message(struct usbtmc_file_data *file_data,
+				  struct iov_iter *from,
+				  const u8 __user *buf, u32 count, bool eom,
+				  u32 *transferred)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct urb *urb = NULL;
+	int retval = 0;
+	u8 *buffer;
+	u32 remaining, done;
+	u32 transfersize, aligned, buflen;
+
+	/* mutex already locked */
+
+	*transferred = 0;
 	done = 0;
 
 	spin_lock_irq(&file_data->err_lock);
@@ -1759,13 +4251,8 @@ static ssize_t usbtmc_write(struct file *filp, const char __user *buf,
 	buffer = urb->transfer_buffer;
 	buflen = urb->transfer_buffer_length;
 
-	if (count > INT_MAX) {
-		transfersize = INT_MAX;
-		buffer[8] = 0;
-	} else {
-		transfersize = count;
-		buffer[8] = file_data->eom_val;
-	}
+	transfersize = count;
+	buffer[8] = eom ? file_data->eom_val : 0;
 
 	/* Setup IO buffer for DEV_DEP_MSG_OUT message */
 	buffer[0] = 1;
@@ -1790,7 +4277,8 @@ static ssize_t usbtmc_write(struct file *filp, const char __user *buf,
 		aligned = (transfersize + (USBTMC_HEADER_SIZE + 3)) & ~3;
 	}
 
-	if (copy_from_user(&buffer[USBTMC_HEADER_SIZE], buf, transfersize)) {
+	if (copy_from_iter(&buffer[USBTMC_HEADER_SIZE], transfersize,
+			   from) != transfersize) {
 		retval = -EFAULT;
 		usbtmc_return_out_urb(file_data, urb);
 		goto exit;
@@ -1815,33 +4303,235 @@ static ssize_t usbtmc_write(struct file *filp, const char __user *buf,
 		goto exit;
 	}
 
-	remaining -= transfersize;
+	remaining -= transfersize;
+
+	data->bTag_last_write = data->bTag;
+	data->bTag++;
+
+	if (!data->bTag)
+		data->bTag++;
+
+	/* call generic_write even when remaining == 0 to wait for completion */
+	if (buf)
+		retval = usbtmc_generic_write(file_data, buf + transfersize,
+					      remaining, &done,
+					      USBTMC_FLAG_APPEND);
+	else
+		retval = __usbtmc_generic_write(file_data, from, remaining,
+						&done, USBTMC_FLAG_APPEND);
+	/* truncate alignment bytes */
+	if (done > remaining)
+		done = remaining;
+
+	/*add size of first urb*/
+	done += transfersize;
+
+	if (retval < 0) {
+		dev_err(&data->intf->dev, "Unable to send data, error %d\n", (int)retval);
+		usbtmc_ioctl_abort_bulk_out(data);
+		goto exit;
+	}
+
+	/* the next write continues the message, see usbtmc_txn_begin() */
+	file_data->out_msg_open = !(eom && file_data->eom_val);
+	*transferred = done;
+	retval = 0;
+exit:
+	return retval;
+}
+
+static int usbtmc_write_message(struct usbtmc_file_data *file_data,
+				const u8 __user *buf, u32 count, bool eom,
+				u32 *transferred)
+{
+	struct iovec iov;
+	struct iov_iter from;
+	int retval;
+
+	*transferred = 0;
+
+	retval = usbtmc_import_ubuf(WRITE, (void __user *)buf, count,
+				    &iov, &from);
+	if (retval < 0)
+		return retval;
+
+	return __usbtmc_write_message(file_data, &from, buf, count, eom,
+				      transferred);
+}
+
+static ssize_t usbtmc_write(struct file *filp, const char __user *buf,
+			    size_t count, loff_t *f_pos)
+{
+	struct usbtmc_file_data *file_data = filp->private_data;
+	struct usbtmc_device_data *data = file_data->data;
+	u32 done = 0;
+	bool eom = true;
+	ssize_t retval;
+
+	retval = usbtmc_txn_begin(file_data, file_data->out_msg_open);
+	if (retval < 0)
+		return retval;
+
+	mutex_lock(&data->io_mutex);
+
+	if (data->zombie) {
+		retval = -ENODEV;
+		goto exit;
+	}
+
+	if (count > INT_MAX) {
+		count = INT_MAX;
+		eom = false;
+	}
+
+	retval = usbtmc_write_message(file_data, buf, count, eom, &done);
+	if (retval < 0)
+		goto exit;
+
+	retval = done;
+exit:
+	mutex_unlock(&data->io_mutex);
+	usbtmc_txn_end(file_data, retval >= 0 ? usbtmc_write_hold(file_data) :
+			USBTMC_TXN_RELEASE);
+	return retval;
+}
+
+/*
+ * Reads a message of up to 64 bit size. The message is requested in
+ * chunks of USBTMC_MSG_CHUNK bytes until the device sets EOM or sends
+ * the term char.
+ */
+static int usbtmc_ioctl_read_msg64(struct usbtmc_file_data *file_data,
+				   void __user *arg)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_message64 msg;
+	u8 __user *buf;
+	u64 done = 0;
+	u32 chunk, actual;
+	int retval = 0;
+
+	/* mutex already locked */
+
+	if (copy_from_user(&msg, arg, sizeof(msg)))
+		return -EFAULT;
+
+	buf = u64_to_user_ptr(msg.message);
+
+	while (done < msg.transfer_size) {
+		chunk = min_t(u64, msg.transfer_size - done, USBTMC_MSG_CHUNK);
+		file_data->bmTransferAttributes = 0;
+
+		retval = usbtmc_read_message(file_data, buf + done, chunk,
+					     &actual, false);
+		done += actual;
+		if (retval < 0 || actual == 0)
+			break;
+
+		/* EOM or term char: end of message */
+		if (file_data->bmTransferAttributes & 0x03)
+			break;
+	}
+
+	dev_dbg(&data->intf->dev, "%s: requested=%llu done=%llu ret=%d\n",
+		__func__, (unsigned long long)msg.transfer_size,
+		(unsigned long long)done, retval);
+
+	if (put_user(done, &((struct usbtmc_message64 __user *)arg)->transferred))
+		return -EFAULT;
+
+	return retval;
+}
+
+/*
+ * Writes a message of up to 64 bit size as a chain of DEV_DEP_MSG_OUT
+ * transfers of USBTMC_MSG_CHUNK bytes. Only the last one carries EOM.
+ */
+static int usbtmc_ioctl_write_msg64(struct usbtmc_file_data *file_data,
+				    void __user *arg)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_message64 msg;
+	const u8 __user *buf;
+	u64 done = 0;
+	u32 chunk, actual;
+	int retval = 0;
+
+	/* mutex already locked */
+
+	if (copy_from_user(&msg, arg, sizeof(msg)))
+		return -EFAULT;
+
+	buf = u64_to_user_ptr(msg.message);
+
+	while (done < msg.transfer_size) {
+		chunk = min_t(u64, msg.transfer_size - done, USBTMC_MSG_CHUNK);
+
+		retval = usbtmc_write_message(file_data, buf + done, chunk,
+					      done + chunk == msg.transfer_size,
+					      &actual);
+		done += actual;
+		if (retval < 0)
+			break;
+		if (actual < chunk) {
+			retval = -EIO;
+			break;
+		}
+	}
+
+	dev_dbg(&data->intf->dev, "%s: requested=%llu done=%llu ret=%d\n",
+		__func__, (unsigned long long)msg.transfer_size,
+		(unsigned long long)done, retval);
+
+	if (put_user(done, &((struct usbtmc_message64 __user *)arg)->transferred))
+		return -EFAULT;
+
+	return retval;
+}
 
-	data->bTag_last_write = data->bTag;
-	data->bTag++;
+/*
+ * Sends a command message and reads the response under one hold of
+ * io_mutex, saving a syscall and a lock round trip per query.
+ */
+static int usbtmc_ioctl_query(struct usbtmc_file_data *file_data,
+			      void __user *arg)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_query query;
+	u32 written = 0;
+	u32 transferred = 0;
+	int retval;
 
-	if (!data->bTag)
-		data->bTag++;
+	/* mutex already locked */
 
-	/* call generic_write even when remaining == 0 to wait for completion */
-	retval = usbtmc_generic_write(file_data, buf + transfersize, remaining,
-				      &done, USBTMC_FLAG_APPEND);
-	/* truncate alignment bytes */
-	if (done > remaining)
-		done = remaining;
+	if (copy_from_user(&query, arg, sizeof(query)))
+		return -EFAULT;
 
-	/*add size of first urb*/
-	done += transfersize;
+	if (query.command_size == 0 || query.command_size > INT_MAX ||
+	    query.response_size > INT_MAX)
+		return -EINVAL;
 
-	if (retval < 0) {
-		dev_err(&data->intf->dev, "Unable to send data, error %d\n", (int)retval);
-		usbtmc_ioctl_abort_bulk_out(data);
+	retval = usbtmc_write_message(file_data,
+				      u64_to_user_ptr(query.command),
+				      query.command_size, true, &written);
+	if (retval < 0)
+		goto exit;
+
+	if (written < query.command_size) {
+		dev_dbg(&data->intf->dev, "%s: short write %u < %u\n",
+			__func__, written, query.command_size);
+		retval = -EIO;
 		goto exit;
 	}
 
-	retval = done;
+	retval = usbtmc_read_message(file_data,
+				     u64_to_user_ptr(query.response),
+				     query.response_size, &transferred, false);
 exit:
-	mutex_unlock(&data->io_mutex);
+	if (put_user(transferred,
+		     &((struct usbtmc_query __user *)arg)->transferred))
+		return -EFAULT;
+
 	return retval;
 }
 
@@ -1849,6 +4539,7 @@ static int usbtmc_ioctl_clear(struct usbtmc_file_data *file_data)
 {
 	struct usbtmc_device_data *data = file_data->data;
 	struct device *dev = &data->intf->dev;
+	const u32 bufsize = usbtmc_drain_size(data);
 	u8 *buffer;
 	int rv;
 	int n;
@@ -1857,7 +4548,7 @@ static int usbtmc_ioctl_clear(struct usbtmc_file_data *file_data)
 
 	dev_dbg(dev, "Sending INITIATE_CLEAR request\n");
 
-	buffer = kmalloc(max((u16)2, data->bin_bsiz), GFP_KERNEL);
+	buffer = kmalloc(bufsize, GFP_KERNEL);
 	if (!buffer)
 		return -ENOMEM;
 
@@ -1914,7 +4605,7 @@ usbtmc_clear_check_status:
 			rv = usb_bulk_msg(data->usb_dev,
 					  usb_rcvbulkpipe(data->usb_dev,
 							  data->bulk_in),
-					  buffer, data->bin_bsiz,
+					  buffer, bufsize,
 					  &actual, file_data->timeout);
 
 			print_hex_dump_debug("usbtmc ", DUMP_PREFIX_NONE,
@@ -1927,7 +4618,7 @@ usbtmc_clear_check_status:
 					rv);
 				goto exit;
 			}
-		} while ((actual == data->bin_bsiz) &&
+		} while ((actual == bufsize) &&
 			  (n < USBTMC_MAX_READS_TO_CLEAR_BULK_IN));
 	} else {
 		/* do not stress device with subsequent requests */
@@ -1996,8 +4687,10 @@ static int usbtmc_ioctl_cancel_io(struct usbtmc_file_data *file_data)
 
 static int usbtmc_ioctl_cleanup_io(struct usbtmc_file_data *file_data)
 {
+	usbtmc_stream_stop(file_data);
 	usb_kill_anchored_urbs(&file_data->submitted_in);
-	usb_scuttle_anchored_urbs(&file_data->in_anchor);
+	usbtmc_recover_in_urbs(file_data);
+	usbtmc_ring_stop(file_data);
 	usbtmc_recover_out_urbs(file_data);
 	spin_lock_irq(&file_data->err_lock);
 	file_data->in_status = 0;
@@ -2068,11 +4761,194 @@ capability_attribute(device_capabilities);
 capability_attribute(usb488_interface_capabilities);
 capability_attribute(usb488_device_capabilities);
 
+/* Default queue depths for file handles opened after the change */
+#define queue_depth_attribute(name)					\
+static ssize_t name##_show(struct device *dev,				\
+			   struct device_attribute *attr, char *buf)	\
+{									\
+	struct usb_interface *intf = to_usb_interface(dev);		\
+	struct usbtmc_device_data *data = usb_get_intfdata(intf);	\
+									\
+	return sprintf(buf, "%u\n", data->name);			\
+}									\
+static ssize_t name##_store(struct device *dev,				\
+			    struct device_attribute *attr,		\
+			    const char *buf, size_t count)		\
+{									\
+	struct usb_interface *intf = to_usb_interface(dev);		\
+	struct usbtmc_device_data *data = usb_get_intfdata(intf);	\
+	unsigned int val;						\
+	int rv;								\
+									\
+	rv = kstrtouint(buf, 0, &val);					\
+	if (rv)								\
+		return rv;						\
+	if (val < USBTMC_MIN_QUEUE_DEPTH || val > USBTMC_MAX_QUEUE_DEPTH) \
+		return -EINVAL;						\
+	data->name = val;						\
+	return count;							\
+}									\
+static DEVICE_ATTR_RW(name)
+
+queue_depth_attribute(in_queue_depth);
+queue_depth_attribute(out_queue_depth);
+
+/* Device wide limit of urb buffer memory in bytes, 0 = unlimited */
+static ssize_t urb_memory_limit_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct usbtmc_device_data *data = usb_get_intfdata(intf);
+
+	return sprintf(buf, "%lu\n", READ_ONCE(data->urb_mem_limit));
+}
+
+static ssize_t urb_memory_limit_store(struct device *dev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct usbtmc_device_data *data = usb_get_intfdata(intf);
+	unsigned long val;
+	int rv;
+
+	rv = kstrtoul(buf, 0, &val);
+	if (rv)
+		return rv;
+
+	mutex_lock(&data->io_mutex);
+	WRITE_ONCE(data->urb_mem_limit, val);
+	if (usbtmc_over_budget(data))
+		usbtmc_trim_stashes(data);
+	mutex_unlock(&data->io_mutex);
+	return count;
+}
+static DEVICE_ATTR_RW(urb_memory_limit);
+
+static ssize_t urb_memory_used_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct usbtmc_device_data *data = usb_get_intfdata(intf);
+
+	return sprintf(buf, "%ld\n", atomic_long_read(&data->urb_mem));
+}
+static DEVICE_ATTR_RO(urb_memory_used);
+
+static ssize_t in_stash_hits_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct usbtmc_device_data *data = usb_get_intfdata(intf);
+
+	return sprintf(buf, "%ld\n", atomic_long_read(&data->in_stash_hits));
+}
+static DEVICE_ATTR_RO(in_stash_hits);
+
+static ssize_t in_stash_misses_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct usbtmc_device_data *data = usb_get_intfdata(intf);
+
+	return sprintf(buf, "%ld\n", atomic_long_read(&data->in_stash_misses));
+}
+static DEVICE_ATTR_RO(in_stash_misses);
+
+static void usbtmc_apply_bsiz(struct usbtmc_device_data *data)
+{
+	struct usbtmc_file_data *file_data;
+
+	/* io_mutex held */
+	list_for_each_entry(file_data, &data->file_list, file_elem) {
+		if (usbtmc_set_bsiz(file_data, data->bin_bsiz, data->bout_bsiz))
+			dev_dbg(&data->intf->dev, "%s: file handle busy\n",
+				__func__);
+	}
+}
+
+/*
+ * Bulk buffer sizes of the device. A change applies to new and idle file
+ * handles, handles with IO in progress keep their sizes.
+ */
+#define bufsize_attribute(name, field, maxp)				\
+static ssize_t name##_show(struct device *dev,				\
+			   struct device_attribute *attr, char *buf)	\
+{									\
+	struct usb_interface *intf = to_usb_interface(dev);		\
+	struct usbtmc_device_data *data = usb_get_intfdata(intf);	\
+									\
+	return sprintf(buf, "%u\n", data->field);			\
+}									\
+static ssize_t name##_store(struct device *dev,				\
+			    struct device_attribute *attr,		\
+			    const char *buf, size_t count)		\
+{									\
+	struct usb_interface *intf = to_usb_interface(dev);		\
+	struct usbtmc_device_data *data = usb_get_intfdata(intf);	\
+	unsigned int val;						\
+	int rv;								\
+									\
+	rv = kstrtouint(buf, 0, &val);					\
+	if (rv)								\
+		return rv;						\
+	if (!val)							\
+		return -EINVAL;						\
+									\
+	mutex_lock(&data->io_mutex);					\
+	data->field = usbtmc_round_bsiz(val, data->maxp);		\
+	usbtmc_apply_bsiz(data);					\
+	mutex_unlock(&data->io_mutex);					\
+	return count;							\
+}									\
+static DEVICE_ATTR_RW(name)
+
+bufsize_attribute(bulk_in_bufsize, bin_bsiz, bin_maxp);
+bufsize_attribute(bulk_out_bufsize, bout_bsiz, bout_maxp);
+
+/* Upper bound of the time a writer keeps the device, 0: its IO timeout */
+static ssize_t transaction_hold_ms_show(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct usbtmc_device_data *data = usb_get_intfdata(intf);
+
+	return sprintf(buf, "%u\n", READ_ONCE(data->txn_hold_ms));
+}
+
+static ssize_t transaction_hold_ms_store(struct device *dev,
+					 struct device_attribute *attr,
+					 const char *buf, size_t count)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct usbtmc_device_data *data = usb_get_intfdata(intf);
+	unsigned int val;
+	int rv;
+
+	rv = kstrtouint(buf, 0, &val);
+	if (rv)
+		return rv;
+
+	WRITE_ONCE(data->txn_hold_ms, val);
+	return count;
+}
+static DEVICE_ATTR_RW(transaction_hold_ms);
+
 static struct attribute *usbtmc_attrs[] = {
 	&dev_attr_interface_capabilities.attr,
 	&dev_attr_device_capabilities.attr,
 	&dev_attr_usb488_interface_capabilities.attr,
 	&dev_attr_usb488_device_capabilities.attr,
+	&dev_attr_in_queue_depth.attr,
+	&dev_attr_out_queue_depth.attr,
+	&dev_attr_urb_memory_limit.attr,
+	&dev_attr_urb_memory_used.attr,
+	&dev_attr_in_stash_hits.attr,
+	&dev_attr_in_stash_misses.attr,
+	&dev_attr_bulk_in_bufsize.attr,
+	&dev_attr_bulk_out_bufsize.attr,
+	&dev_attr_transaction_hold_ms.attr,
 	NULL,
 };
 ATTRIBUTE_GROUPS(usbtmc);
@@ -2133,7 +5009,8 @@ static int usbtmc_ioctl_request(struct usbtmc_device_data *data,
 	if (in_compat_syscall())
 		request.data = compat_ptr((compat_uptr_t)r->data);
 
-	if (request.req.wLength > data->bin_bsiz)
+	/* wLength is at most 64 KiB, bin_bsiz may be smaller or much larger */
+	if (request.req.wLength > max_t(u32, data->bin_bsiz, USBTMC_BUFSIZE))
 		return -EMSGSIZE;
 	if (request.req.wLength == 0)	/* Length-0 requests are never IN */
 		request.req.bRequestType &= ~USB_DIR_IN;
@@ -2178,97 +5055,456 @@ static int usbtmc_ioctl_request(struct usbtmc_device_data *data,
 			rv = -EFAULT;
 	}
 
- exit:
-	kfree(buffer);
-	return rv;
+ exit:
+	kfree(buffer);
+	return rv;
+}
+
+/*
+ * Get the usb timeout value
+ */
+static int usbtmc_ioctl_get_timeout(struct usbtmc_file_data *file_data,
+				void __user *arg)
+{
+	u32 timeout;
+
+	timeout = READ_ONCE(file_data->timeout);
+
+	return put_user(timeout, (__u32 __user *)arg);
+}
+
+/*
+ * Set the usb timeout value
+ */
+static int usbtmc_ioctl_set_timeout(struct usbtmc_file_data *file_data,
+				void __user *arg)
+{
+	u32 timeout;
+
+	if (get_user(timeout, (__u32 __user *)arg))
+		return -EFAULT;
+
+	/* Note that timeout = 0 means
+	 * MAX_SCHEDULE_TIMEOUT in usb_control_msg
+	 */
+	if (timeout < USBTMC_MIN_TIMEOUT)
+		return -EINVAL;
+
+	WRITE_ONCE(file_data->timeout, timeout);
+
+	return 0;
+}
+
+/*
+ * enables/disables sending EOM on write
+ */
+static int usbtmc_ioctl_eom_enable(struct usbtmc_file_data *file_data,
+				void __user *arg)
+{
+	u8 eom_enable;
+
+	if (copy_from_user(&eom_enable, arg, sizeof(eom_enable)))
+		return -EFAULT;
+
+	if (eom_enable > 1)
+		return -EINVAL;
+
+	file_data->eom_val = eom_enable;
+
+	return 0;
+}
+
+/*
+ * Configure termination character for read()
+ */
+static int usbtmc_ioctl_config_termc(struct usbtmc_file_data *file_data,
+				void __user *arg)
+{
+	struct usbtmc_termchar termc;
+
+	if (copy_from_user(&termc, arg, sizeof(termc)))
+		return -EFAULT;
+
+	if ((termc.term_char_enabled > 1) ||
+		(termc.term_char_enabled &&
+		!(file_data->data->capabilities.device_capabilities & 1)))
+		return -EINVAL;
+
+	file_data->term_char = termc.term_char;
+	file_data->term_char_enabled = termc.term_char_enabled;
+
+	return 0;
+}
+
+/*
+ * Get the bulk urb queue depths of the file handle
+ */
+static int usbtmc_ioctl_get_queue_depth(struct usbtmc_file_data *file_data,
+					void __user *arg)
+{
+	struct usbtmc_queue_depth depth;
+
+	depth.in_urbs = file_data->in_depth.max;
+	depth.out_urbs = file_data->out_depth.max;
+	depth.flags = file_data->adaptive_depth ?
+		USBTMC_QUEUE_DEPTH_ADAPTIVE : 0;
+
+	if (copy_to_user(arg, &depth, sizeof(depth)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/*
+ * Set the bulk urb queue depths of the file handle.
+ * A depth of 0 selects the device default.
+ */
+static int usbtmc_ioctl_set_queue_depth(struct usbtmc_file_data *file_data,
+					void __user *arg)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_queue_depth depth;
+
+	if (copy_from_user(&depth, arg, sizeof(depth)))
+		return -EFAULT;
+
+	if ((depth.in_urbs && depth.in_urbs < USBTMC_MIN_QUEUE_DEPTH) ||
+	    (depth.out_urbs && depth.out_urbs < USBTMC_MIN_QUEUE_DEPTH) ||
+	    depth.in_urbs > USBTMC_MAX_QUEUE_DEPTH ||
+	    depth.out_urbs > USBTMC_MAX_QUEUE_DEPTH ||
+	    (depth.flags & ~USBTMC_QUEUE_DEPTH_ADAPTIVE))
+		return -EINVAL;
+
+	file_data->in_depth.max = depth.in_urbs ? : data->in_queue_depth;
+	file_data->out_depth.max = depth.out_urbs ? : data->out_queue_depth;
+	file_data->in_depth.calm = 0;
+	file_data->out_depth.calm = 0;
+	file_data->adaptive_depth = !!(depth.flags & USBTMC_QUEUE_DEPTH_ADAPTIVE);
+
+	return 0;
+}
+
+/*
+ * Get the bulk urb buffer sizes of the file handle
+ */
+static int usbtmc_ioctl_get_bufsize(struct usbtmc_file_data *file_data,
+				    void __user *arg)
+{
+	struct usbtmc_bufsize bsiz;
+
+	bsiz.in_size = file_data->bin_bsiz;
+	bsiz.out_size = file_data->bout_bsiz;
+
+	if (copy_to_user(arg, &bsiz, sizeof(bsiz)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/*
+ * Set the bulk urb buffer sizes of the file handle and return the sizes
+ * in effect. Fails with -EBUSY while IO is in progress.
+ */
+static int usbtmc_ioctl_set_bufsize(struct usbtmc_file_data *file_data,
+				    void __user *arg)
+{
+	struct usbtmc_bufsize bsiz;
+	int retval;
+
+	if (copy_from_user(&bsiz, arg, sizeof(bsiz)))
+		return -EFAULT;
+
+	retval = usbtmc_set_bsiz(file_data, bsiz.in_size, bsiz.out_size);
+	if (retval < 0)
+		return retval;
+
+	return usbtmc_ioctl_get_bufsize(file_data, arg);
+}
+
+/*
+ * Get the response size history of the file handle and the bulk in urbs
+ * it selects for the next read
+ */
+static int usbtmc_ioctl_get_read_profile(struct usbtmc_file_data *file_data,
+					 void __user *arg)
+{
+	struct usbtmc_read_profile prof;
+	u32 first_size;
+	u32 first_urbs;
+	u32 i;
+
+	BUILD_BUG_ON(ARRAY_SIZE(prof.history) != USBTMC_IN_HIST);
+	memset(&prof, 0, sizeof(prof));
+	/* oldest first */
+	for (i = 0; i < file_data->in_hist_len; i++)
+		prof.history[i] = file_data->in_hist[(file_data->in_hist_pos +
+			USBTMC_IN_HIST - file_data->in_hist_len + i) %
+			USBTMC_IN_HIST];
+	prof.nr_history = file_data->in_hist_len;
+
+	usbtmc_plan_in_urbs(file_data, &first_size, &first_urbs);
+	prof.first_urb_size = first_size;
+	prof.first_urbs = first_urbs;
+	prof.flags = file_data->adaptive_in ? USBTMC_READ_PROFILE_ADAPTIVE : 0;
+
+	if (copy_to_user(arg, &prof, sizeof(prof)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/*
+ * Enable or disable the adaptive bulk in urbs of the file handle.
+ * Clears the response size history.
+ */
+static int usbtmc_ioctl_set_read_profile(struct usbtmc_file_data *file_data,
+					 void __user *arg)
+{
+	struct usbtmc_read_profile prof;
+
+	if (copy_from_user(&prof, arg, sizeof(prof)))
+		return -EFAULT;
+
+	if (prof.flags & ~USBTMC_READ_PROFILE_ADAPTIVE)
+		return -EINVAL;
+
+	file_data->adaptive_in = !!(prof.flags & USBTMC_READ_PROFILE_ADAPTIVE);
+	file_data->in_hist_len = 0;
+	file_data->in_hist_pos = 0;
+
+	return 0;
 }
 
 /*
- * Get the usb timeout value
+ * How a bulk ioctl takes part in the transaction queue:
+ * READ continues the transaction of the owner and keeps the device
+ * while the response is incomplete, WRITE starts a transaction (or
+ * continues a message without EOM) and may reserve the device for the
+ * response, UNIT is a complete transaction, RAW is a generic transfer
+ * that may be any part of a transaction, RESET ends the transaction.
  */
-static int usbtmc_ioctl_get_timeout(struct usbtmc_file_data *file_data,
-				void __user *arg)
-{
-	u32 timeout;
-
-	timeout = file_data->timeout;
+enum usbtmc_txn_class {
+	USBTMC_TXN_NONE,
+	USBTMC_TXN_READ,
+	USBTMC_TXN_WRITE,
+	USBTMC_TXN_UNIT,
+	USBTMC_TXN_RAW,
+	USBTMC_TXN_RESET,
+};
 
-	return put_user(timeout, (__u32 __user *)arg);
+static enum usbtmc_txn_class usbtmc_ioctl_txn(struct usbtmc_file_data *file_data,
+					      unsigned int cmd)
+{
+	switch (cmd) {
+	case USBTMC_IOCTL_READ_BLOCK:
+	case USBTMC_IOCTL_READ_MSG64:
+		return USBTMC_TXN_READ;
+	case USBTMC_IOCTL_WRITE_MSG64:
+		return USBTMC_TXN_WRITE;
+	case USBTMC_IOCTL_QUERY:
+	case USBTMC488_IOCTL_TRIGGER:
+		return USBTMC_TXN_UNIT;
+	case USBTMC_IOCTL_READ:
+	case USBTMC_IOCTL_WRITE:
+	case USBTMC_IOCTL_RING_READ:
+		return USBTMC_TXN_RAW;
+	case USBTMC_IOCTL_CLEAR:
+	case USBTMC_IOCTL_ABORT_BULK_OUT:
+	case USBTMC_IOCTL_ABORT_BULK_IN:
+	case USBTMC_IOCTL_CLEAR_OUT_HALT:
+	case USBTMC_IOCTL_CLEAR_IN_HALT:
+		return USBTMC_TXN_RESET;
+	}
+	return USBTMC_TXN_NONE;
 }
 
 /*
- * Set the usb timeout value
+ * Priority of the file handle in the transaction queue. Takes effect
+ * with the next turn, see usbtmc_txn_begin().
  */
-static int usbtmc_ioctl_set_timeout(struct usbtmc_file_data *file_data,
-				void __user *arg)
+static int usbtmc_ioctl_set_priority(struct usbtmc_file_data *file_data,
+				     __u8 __user *arg)
 {
-	u32 timeout;
+	struct usbtmc_device_data *data = file_data->data;
+	__u8 priority;
 
-	if (get_user(timeout, (__u32 __user *)arg))
+	if (get_user(priority, arg))
 		return -EFAULT;
 
-	/* Note that timeout = 0 means
-	 * MAX_SCHEDULE_TIMEOUT in usb_control_msg
-	 */
-	if (timeout < USBTMC_MIN_TIMEOUT)
+	if (priority > USBTMC_PRIORITY_HIGH)
 		return -EINVAL;
 
-	file_data->timeout = timeout;
+	WRITE_ONCE(file_data->priority, priority);
 
+	dev_dbg(&data->intf->dev, "%s: priority %u\n", __func__, priority);
 	return 0;
 }
 
 /*
- * enables/disables sending EOM on write
+ * ioctls on per file state, SRQ state and constants. They do not wait
+ * for IO of other file handles. Returns -ENOIOCTLCMD for other commands.
  */
-static int usbtmc_ioctl_eom_enable(struct usbtmc_file_data *file_data,
-				void __user *arg)
+static long usbtmc_ioctl_nolock(struct usbtmc_file_data *file_data,
+				unsigned int cmd, unsigned long arg)
 {
-	u8 eom_enable;
+	struct usbtmc_device_data *data = file_data->data;
+	__u8 tmp_byte;
+	int retval;
 
-	if (copy_from_user(&eom_enable, arg, sizeof(eom_enable)))
-		return -EFAULT;
+	switch (cmd) {
+	case USBTMC_IOCTL_GET_TIMEOUT:
+		return usbtmc_ioctl_get_timeout(file_data, (void __user *)arg);
 
-	if (eom_enable > 1)
-		return -EINVAL;
+	case USBTMC_IOCTL_SET_TIMEOUT:
+		return usbtmc_ioctl_set_timeout(file_data, (void __user *)arg);
 
-	file_data->eom_val = eom_enable;
+	case USBTMC_IOCTL_API_VERSION:
+		return put_user(USBTMC_API_VERSION, (__u32 __user *)arg);
 
-	return 0;
+	case USBTMC488_IOCTL_GET_CAPS:
+		return put_user(data->usb488_caps, (unsigned char __user *)arg);
+
+	case USBTMC488_IOCTL_WAIT_SRQ:
+		return usbtmc488_ioctl_wait_srq(file_data, (__u32 __user *)arg);
+
+	case USBTMC_IOCTL_MSG_IN_ATTR:
+		return put_user(READ_ONCE(file_data->bmTransferAttributes),
+				(__u8 __user *)arg);
+
+	case USBTMC_IOCTL_AUTO_ABORT:
+		retval = get_user(tmp_byte, (unsigned char __user *)arg);
+		if (retval == 0)
+			WRITE_ONCE(file_data->auto_abort, !!tmp_byte);
+		return retval;
+
+	case USBTMC_IOCTL_GET_SRQ_STB:
+		return usbtmc_ioctl_get_srq_stb(file_data, (void __user *)arg);
+
+	case USBTMC_IOCTL_GET_QUEUE_DEPTH:
+		return usbtmc_ioctl_get_queue_depth(file_data,
+						    (void __user *)arg);
+
+	case USBTMC_IOCTL_GET_BUFSIZE:
+		return usbtmc_ioctl_get_bufsize(file_data, (void __user *)arg);
+
+	case USBTMC_IOCTL_GET_PRIORITY:
+		return put_user(READ_ONCE(file_data->priority),
+				(__u8 __user *)arg);
+
+	case USBTMC_IOCTL_SET_PRIORITY:
+		return usbtmc_ioctl_set_priority(file_data,
+						 (__u8 __user *)arg);
+	}
+
+	return -ENOIOCTLCMD;
 }
 
 /*
- * Configure termination character for read()
+ * ioctls that only use the control pipe. They are serialized by
+ * ctrl_mutex, not by io_mutex, so status polling does not queue behind
+ * bulk transfers. Returns -ENOIOCTLCMD for other commands.
  */
-static int usbtmc_ioctl_config_termc(struct usbtmc_file_data *file_data,
-				void __user *arg)
+static long usbtmc_ioctl_ctrl(struct usbtmc_file_data *file_data,
+			      unsigned int cmd, unsigned long arg)
 {
-	struct usbtmc_termchar termc;
+	struct usbtmc_device_data *data = file_data->data;
+	__u8 tmp_byte;
+	int retval;
 
-	if (copy_from_user(&termc, arg, sizeof(termc)))
-		return -EFAULT;
+	switch (cmd) {
+	case USBTMC_IOCTL_INDICATOR_PULSE:
+	case USBTMC_IOCTL_CTRL_REQUEST:
+	case USBTMC488_IOCTL_READ_STB:
+	case USBTMC488_IOCTL_REN_CONTROL:
+	case USBTMC488_IOCTL_GOTO_LOCAL:
+	case USBTMC488_IOCTL_LOCAL_LOCKOUT:
+	case USBTMC_IOCTL_GET_STB:
+		break;
+	default:
+		return -ENOIOCTLCMD;
+	}
 
-	if ((termc.term_char_enabled > 1) ||
-		(termc.term_char_enabled &&
-		!(file_data->data->capabilities.device_capabilities & 1)))
-		return -EINVAL;
+	mutex_lock(&data->ctrl_mutex);
+	if (data->zombie) {
+		retval = -ENODEV;
+		goto skip_io_on_zombie;
+	}
 
-	file_data->term_char = termc.term_char;
-	file_data->term_char_enabled = termc.term_char_enabled;
+	switch (cmd) {
+	case USBTMC_IOCTL_INDICATOR_PULSE:
+		retval = usbtmc_ioctl_indicator_pulse(data);
+		break;
 
-	return 0;
+	case USBTMC_IOCTL_CTRL_REQUEST:
+		retval = usbtmc_ioctl_request(data, (void __user *)arg);
+		break;
+
+	case USBTMC488_IOCTL_READ_STB:
+		retval = usbtmc488_ioctl_read_stb(file_data,
+						  (void __user *)arg);
+		break;
+
+	case USBTMC488_IOCTL_REN_CONTROL:
+		retval = usbtmc488_ioctl_simple(data, (void __user *)arg,
+						USBTMC488_REQUEST_REN_CONTROL);
+		break;
+
+	case USBTMC488_IOCTL_GOTO_LOCAL:
+		retval = usbtmc488_ioctl_simple(data, (void __user *)arg,
+						USBTMC488_REQUEST_GOTO_LOCAL);
+		break;
+
+	case USBTMC488_IOCTL_LOCAL_LOCKOUT:
+		retval = usbtmc488_ioctl_simple(data, (void __user *)arg,
+						USBTMC488_REQUEST_LOCAL_LOCKOUT);
+		break;
+
+	default: /* USBTMC_IOCTL_GET_STB */
+		retval = usbtmc_get_stb(file_data, &tmp_byte);
+		if (!retval)
+			retval = put_user(tmp_byte, (__u8 __user *)arg);
+		break;
+	}
+
+skip_io_on_zombie:
+	mutex_unlock(&data->ctrl_mutex);
+	return retval;
 }
 
 static long usbtmc_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct usbtmc_file_data *file_data;
 	struct usbtmc_device_data *data;
-	int retval = -EBADRQC;
-	__u8 tmp_byte;
+	enum usbtmc_txn_class txn;
+	int retval;
 
 	file_data = file->private_data;
 	data = file_data->data;
 
+	if (READ_ONCE(data->zombie))
+		return -ENODEV;
+
+	retval = usbtmc_ioctl_nolock(file_data, cmd, arg);
+	if (retval != -ENOIOCTLCMD)
+		return retval;
+
+	retval = usbtmc_ioctl_ctrl(file_data, cmd, arg);
+	if (retval != -ENOIOCTLCMD)
+		return retval;
+
+	txn = usbtmc_ioctl_txn(file_data, cmd);
+	if (txn != USBTMC_TXN_NONE) {
+		if (txn == USBTMC_TXN_WRITE)
+			retval = usbtmc_txn_begin(file_data,
+						  file_data->out_msg_open);
+		else
+			retval = usbtmc_txn_begin(file_data,
+						  txn != USBTMC_TXN_UNIT);
+		if (retval < 0)
+			return retval;
+	}
+	retval = -EBADRQC;
+
 	mutex_lock(&data->io_mutex);
 	if (data->zombie) {
 		retval = -ENODEV;
@@ -2284,10 +5520,6 @@ static long usbtmc_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		retval = usbtmc_ioctl_clear_in_halt(data);
 		break;
 
-	case USBTMC_IOCTL_INDICATOR_PULSE:
-		retval = usbtmc_ioctl_indicator_pulse(data);
-		break;
-
 	case USBTMC_IOCTL_CLEAR:
 		retval = usbtmc_ioctl_clear(file_data);
 		break;
@@ -2300,20 +5532,6 @@ static long usbtmc_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		retval = usbtmc_ioctl_abort_bulk_in(data);
 		break;
 
-	case USBTMC_IOCTL_CTRL_REQUEST:
-		retval = usbtmc_ioctl_request(data, (void __user *)arg);
-		break;
-
-	case USBTMC_IOCTL_GET_TIMEOUT:
-		retval = usbtmc_ioctl_get_timeout(file_data,
-						  (void __user *)arg);
-		break;
-
-	case USBTMC_IOCTL_SET_TIMEOUT:
-		retval = usbtmc_ioctl_set_timeout(file_data,
-						  (void __user *)arg);
-		break;
-
 	case USBTMC_IOCTL_EOM_ENABLE:
 		retval = usbtmc_ioctl_eom_enable(file_data,
 						 (void __user *)arg);
@@ -2339,73 +5557,70 @@ static long usbtmc_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 						   (void __user *)arg);
 		break;
 
-	case USBTMC_IOCTL_API_VERSION:
-		retval = put_user(USBTMC_API_VERSION,
-				  (__u32 __user *)arg);
+	case USBTMC488_IOCTL_TRIGGER:
+		retval = usbtmc488_ioctl_trigger(file_data);
 		break;
 
-	case USBTMC488_IOCTL_GET_CAPS:
-		retval = put_user(data->usb488_caps,
-				  (unsigned char __user *)arg);
+	case USBTMC_IOCTL_CANCEL_IO:
+		retval = usbtmc_ioctl_cancel_io(file_data);
 		break;
 
-	case USBTMC488_IOCTL_READ_STB:
-		retval = usbtmc488_ioctl_read_stb(file_data,
-						  (void __user *)arg);
+	case USBTMC_IOCTL_CLEANUP_IO:
+		retval = usbtmc_ioctl_cleanup_io(file_data);
 		break;
 
-	case USBTMC488_IOCTL_REN_CONTROL:
-		retval = usbtmc488_ioctl_simple(data, (void __user *)arg,
-						USBTMC488_REQUEST_REN_CONTROL);
+	case USBTMC_IOCTL_RING_SETUP:
+		retval = usbtmc_ioctl_ring_setup(file_data,
+						 (void __user *)arg);
 		break;
 
-	case USBTMC488_IOCTL_GOTO_LOCAL:
-		retval = usbtmc488_ioctl_simple(data, (void __user *)arg,
-						USBTMC488_REQUEST_GOTO_LOCAL);
+	case USBTMC_IOCTL_RING_READ:
+		retval = usbtmc_ioctl_ring_read(file_data,
+						(void __user *)arg);
 		break;
 
-	case USBTMC488_IOCTL_LOCAL_LOCKOUT:
-		retval = usbtmc488_ioctl_simple(data, (void __user *)arg,
-						USBTMC488_REQUEST_LOCAL_LOCKOUT);
+	case USBTMC_IOCTL_RING_RELEASE:
+		retval = usbtmc_ioctl_ring_release(file_data,
+						   (void __user *)arg);
 		break;
 
-	case USBTMC488_IOCTL_TRIGGER:
-		retval = usbtmc488_ioctl_trigger(file_data);
+	case USBTMC_IOCTL_READ_BLOCK:
+		retval = usbtmc_ioctl_read_block(file_data,
+						 (void __user *)arg);
 		break;
 
-	case USBTMC488_IOCTL_WAIT_SRQ:
-		retval = usbtmc488_ioctl_wait_srq(file_data,
-						  (__u32 __user *)arg);
+	case USBTMC_IOCTL_READ_MSG64:
+		retval = usbtmc_ioctl_read_msg64(file_data,
+						 (void __user *)arg);
 		break;
 
-	case USBTMC_IOCTL_MSG_IN_ATTR:
-		retval = put_user(file_data->bmTransferAttributes,
-				  (__u8 __user *)arg);
+	case USBTMC_IOCTL_WRITE_MSG64:
+		retval = usbtmc_ioctl_write_msg64(file_data,
+						  (void __user *)arg);
 		break;
 
-	case USBTMC_IOCTL_AUTO_ABORT:
-		retval = get_user(tmp_byte, (unsigned char __user *)arg);
-		if (retval == 0)
-			file_data->auto_abort = !!tmp_byte;
+	case USBTMC_IOCTL_QUERY:
+		retval = usbtmc_ioctl_query(file_data, (void __user *)arg);
 		break;
 
-	case USBTMC_IOCTL_GET_STB:
-		retval = usbtmc_get_stb(file_data, &tmp_byte);
-		if (!retval)
-			retval = put_user(tmp_byte, (__u8 __user *)arg);
+	case USBTMC_IOCTL_SET_QUEUE_DEPTH:
+		retval = usbtmc_ioctl_set_queue_depth(file_data,
+						      (void __user *)arg);
 		break;
 
-	case USBTMC_IOCTL_GET_SRQ_STB:
-		retval = usbtmc_ioctl_get_srq_stb(file_data,
+	case USBTMC_IOCTL_SET_BUFSIZE:
+		retval = usbtmc_ioctl_set_bufsize(file_data,
 						  (void __user *)arg);
 		break;
 
-	case USBTMC_IOCTL_CANCEL_IO:
-		retval = usbtmc_ioctl_cancel_io(file_data);
+	case USBTMC_IOCTL_GET_READ_PROFILE:
+		retval = usbtmc_ioctl_get_read_profile(file_data,
+						       (void __user *)arg);
 		break;
 
-	case USBTMC_IOCTL_CLEANUP_IO:
-		retval = usbtmc_ioctl_cleanup_io(file_data);
+	case USBTMC_IOCTL_SET_READ_PROFILE:
+		retval = usbtmc_ioctl_set_read_profile(file_data,
+						       (void __user *)arg);
 		break;
 	default:
 		dev_err(&data->intf->dev, "invalid ioctl request %x\n", cmd);
@@ -2413,6 +5628,18 @@ static long usbtmc_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 
 skip_io_on_zombie:
 	mutex_unlock(&data->io_mutex);
+	if (txn != USBTMC_TXN_NONE) {
+		enum usbtmc_txn_hold hold = USBTMC_TXN_RELEASE;
+
+		if (retval >= 0 && txn == USBTMC_TXN_WRITE)
+			hold = usbtmc_write_hold(file_data);
+		else if (retval >= 0 && txn == USBTMC_TXN_RAW)
+			/* PENDING with urbs left posted, see usbtmc_txn_end() */
+			hold = USBTMC_TXN_REPLY;
+		else if (retval >= 0 && txn == USBTMC_TXN_READ)
+			hold = usbtmc_read_hold(file_data);
+		usbtmc_txn_end(file_data, hold);
+	}
 	return retval;
 }
 
@@ -2427,16 +5654,19 @@ static __poll_t usbtmc_poll(struct file *file, poll_table *wait)
 {
 	struct usbtmc_file_data *file_data = file->private_data;
 	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_ring *ring;
 	__poll_t mask;
 
-	mutex_lock(&data->io_mutex);
-
-	if (data->zombie) {
-		mask = EPOLLHUP | EPOLLERR;
-		goto no_poll;
-	}
+	/*
+	 * No io_mutex: readiness is computed from anchors, atomics and
+	 * single word snapshots. The completion handlers wake poll_wait
+	 * after updating them, so edge triggered epoll does not miss a
+	 * change.
+	 */
+	if (READ_ONCE(data->zombie))
+		return EPOLLHUP | EPOLLERR;
 
-	poll_wait(file, &data->waitq, wait);
+	poll_wait(file, &file_data->poll_wait, wait);
 
 	/* Note that EPOLLPRI is now assigned to SRQ, and
 	 * EPOLLIN|EPOLLRDNORM to normal read data.
@@ -2451,18 +5681,24 @@ static __poll_t usbtmc_poll(struct file *file, poll_table *wait)
 	if (usb_anchor_empty(&file_data->submitted_in) &&
 	    usb_anchor_empty(&file_data->submitted_out))
 		mask |= (EPOLLOUT | EPOLLWRNORM);
-	if (!usb_anchor_empty(&file_data->in_anchor))
+	if (!usb_anchor_empty(&file_data->in_anchor) ||
+	    READ_ONCE(file_data->in_partial))
 		mask |= (EPOLLIN | EPOLLRDNORM);
 
-	spin_lock_irq(&file_data->err_lock);
-	if (file_data->in_status || file_data->out_status)
+	if (READ_ONCE(file_data->ring)) {
+		/* the ring is freed after it is unpublished under err_lock */
+		spin_lock_irq(&file_data->err_lock);
+		ring = file_data->ring;
+		if (ring && !usb_anchor_empty(&ring->done))
+			mask |= (EPOLLIN | EPOLLRDNORM);
+		spin_unlock_irq(&file_data->err_lock);
+	}
+
+	if (READ_ONCE(file_data->in_status) || READ_ONCE(file_data->out_status))
 		mask |= EPOLLERR;
-	spin_unlock_irq(&file_data->err_lock);
 
 	dev_dbg(&data->intf->dev, "poll mask = %x\n", mask);
 
-no_poll:
-	mutex_unlock(&data->io_mutex);
 	return mask;
 }
 
@@ -2470,6 +5706,14 @@ static const struct file_operations fops = {
 	.owner		= THIS_MODULE,
 	.read		= usbtmc_read,
 	.write		= usbtmc_write,
+	.read_iter	= usbtmc_read_iter,
+	.write_iter	= usbtmc_write_iter,
+	/* via usbtmc_read_iter(): each splice reads one message */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+	.splice_read	= copy_splice_read,
+#else
+	.splice_read	= generic_file_splice_read,
+#endif
 	.open		= usbtmc_open,
 	.release	= usbtmc_release,
 	.flush		= usbtmc_flush,
@@ -2479,6 +5723,7 @@ static const struct file_operations fops = {
 #endif
 	.fasync         = usbtmc_fasync,
 	.poll           = usbtmc_poll,
+	.mmap		= usbtmc_mmap,
 	.llseek		= default_llseek,
 };
 
@@ -2518,24 +5763,22 @@ static void usbtmc_interrupt(struct urb *urb)
 		}
 		/* check for SRQ notification */
 		if (data->iin_buffer[0] == 0x81) {
-			unsigned long flags;
-			struct list_head *elem;
+			struct usbtmc_file_data *file_data;
 
 			if (data->fasync)
 				kill_fasync(&data->fasync,
 					SIGIO, POLL_PRI);
 
-			spin_lock_irqsave(&data->dev_lock, flags);
-			list_for_each(elem, &data->file_list) {
-				struct usbtmc_file_data *file_data;
-
-				file_data = list_entry(elem,
-						       struct usbtmc_file_data,
-						       file_elem);
-				file_data->srq_byte = data->iin_buffer[1];
-				atomic_set(&file_data->srq_asserted, 1);
+			/* open and release do not wait for the SRQ fan-out */
+			rcu_read_lock();
+			list_for_each_entry_rcu(file_data, &data->file_list,
+						file_elem) {
+				WRITE_ONCE(file_data->srq_byte,
+					   data->iin_buffer[1]);
+				atomic_set_release(&file_data->srq_asserted, 1);
+				usbtmc_wake_poll(file_data, EPOLLPRI);
 			}
-			spin_unlock_irqrestore(&data->dev_lock, flags);
+			rcu_read_unlock();
 
 			dev_dbg(dev, "srq received bTag %x stb %x\n",
 				(unsigned int)data->iin_buffer[0],
@@ -2573,6 +5816,44 @@ static void usbtmc_free_int(struct usbtmc_device_data *data)
 	kref_put(&data->kref, usbtmc_delete);
 }
 
+/*
+ * Default bulk buffer size and queue depth of an endpoint. SuperSpeed
+ * buffers are whole bursts of maxp * (bMaxBurst + 1) bytes, with the
+ * default io_buffer_size they hold USBTMC_SS_BURSTS bursts, and the
+ * queue depth keeps USBTMC_SS_IN_FLIGHT bytes posted.
+ */
+static u32 usbtmc_default_bsiz(struct usbtmc_device_data *data,
+			       struct usb_host_endpoint *ep, u32 *depth)
+{
+	enum usb_device_speed speed = data->usb_dev->speed;
+	u32 maxp = usb_endpoint_maxp(&ep->desc);
+	u32 burst = maxp;
+	u32 size;
+
+	if (speed >= USB_SPEED_SUPER)
+		burst *= ep->ss_ep_comp.bMaxBurst + 1;
+
+	if (io_buffer_size <= maxp) {
+		size = maxp;
+	} else if (speed >= USB_SPEED_SUPER) {
+		size = io_buffer_size;
+		if (size == USBTMC_BUFSIZE)
+			size = max_t(u32, size, burst * USBTMC_SS_BURSTS);
+		size = min_t(u32, roundup(size, burst),
+			     rounddown(USBTMC_MAX_BUFSIZE, burst));
+		*depth = clamp_t(u32, DIV_ROUND_UP(USBTMC_SS_IN_FLIGHT, size),
+				 USBTMC_MIN_QUEUE_DEPTH, 4 * MAX_URBS_IN_FLIGHT);
+	} else {
+		size = io_buffer_size;
+	}
+
+	dev_info(&data->intf->dev,
+		 "bulk %s: %s speed, maxp %u, burst %u, io_buffer_size %u, %u urbs\n",
+		 usb_endpoint_dir_in(&ep->desc) ? "in" : "out",
+		 usb_speed_string(speed), maxp, burst / maxp, size, *depth);
+	return size;
+}
+
 static int usbtmc_probe(struct usb_interface *intf,
 			const struct usb_device_id *id)
 {
@@ -2588,6 +5869,8 @@ static int usbtmc_probe(struct usb_interface *intf,
 	if (io_buffer_size != 0) {
 		if (io_buffer_size < 64)
 			io_buffer_size = 64;
+		if (io_buffer_size > USBTMC_MAX_BUFSIZE)
+			io_buffer_size = USBTMC_MAX_BUFSIZE;
 		io_buffer_size = io_buffer_size - (io_buffer_size % 4);
 		pr_info("Params: io_buffer_size = %d\n", io_buffer_size);
 	} else {
@@ -2597,6 +5880,7 @@ static int usbtmc_probe(struct usb_interface *intf,
 	if (usb_timeout < USBTMC_MIN_TIMEOUT)
 		usb_timeout = USBTMC_MIN_TIMEOUT;
 	pr_info("\tusb_timeout = %d\n", usb_timeout);
+	pr_info("\tcoherent_buffers = %d\n", coherent_buffers);
 
 	data = kzalloc(sizeof(*data), GFP_KERNEL);
 	if (!data)
@@ -2608,13 +5892,31 @@ static int usbtmc_probe(struct usb_interface *intf,
 	usb_set_intfdata(intf, data);
 	kref_init(&data->kref);
 	mutex_init(&data->io_mutex);
+	mutex_init(&data->ctrl_mutex);
 	init_waitqueue_head(&data->waitq);
 	atomic_set(&data->iin_data_valid, 0);
 	INIT_LIST_HEAD(&data->file_list);
 	spin_lock_init(&data->dev_lock);
+	INIT_LIST_HEAD(&data->txn_queue);
+	init_waitqueue_head(&data->txn_wait);
+	data->txn_hold_ms = USBTMC_TXN_HOLD_MS;
+
+	data->aio_wq = alloc_ordered_workqueue("usbtmc-aio-%s", 0,
+					       dev_name(&intf->dev));
+	if (!data->aio_wq) {
+		retcode = -ENOMEM;
+		goto error_register;
+	}
 
 	data->zombie = 0;
 
+	data->in_queue_depth = MAX_URBS_IN_FLIGHT;
+	data->out_queue_depth = MAX_URBS_IN_FLIGHT;
+	data->coherent_buffers = coherent_buffers;
+	atomic_long_set(&data->urb_mem, 0);
+	atomic_long_set(&data->in_stash_hits, 0);
+	atomic_long_set(&data->in_stash_misses, 0);
+
 	/* Initialize USBTMC bTag and other fields */
 	data->bTag	= 1;
 	/*  2 <= bTag <= 127   USBTMC-USB488 subclass specification 4.3.1 */
@@ -2630,12 +5932,10 @@ static int usbtmc_probe(struct usb_interface *intf,
 
 		if (usb_endpoint_is_bulk_in(endpoint)) {
 			data->bulk_in = endpoint->bEndpointAddress;
-			if (io_buffer_size >  usb_endpoint_maxp(endpoint)) {
-				data->bin_bsiz = io_buffer_size;
-			} else {
-				data->bin_bsiz = usb_endpoint_maxp(endpoint);
-				pr_info("bulk in io_buffer_size = %d\n", data->bin_bsiz);
-			}
+			data->bin_maxp = usb_endpoint_maxp(endpoint);
+			data->bin_bsiz = usbtmc_default_bsiz(data,
+						&iface_desc->endpoint[n],
+						&data->in_queue_depth);
 			dev_dbg(&intf->dev, "Found bulk in endpoint at %u\n",
 				data->bulk_in);
 			break;
@@ -2648,12 +5948,10 @@ static int usbtmc_probe(struct usb_interface *intf,
 
 		if (usb_endpoint_is_bulk_out(endpoint)) {
 			data->bulk_out = endpoint->bEndpointAddress;
-			if (io_buffer_size >  usb_endpoint_maxp(endpoint)) {
-				data->bout_bsiz = io_buffer_size;
-			} else {
-				data->bout_bsiz = usb_endpoint_maxp(endpoint);
-				pr_info("bulk out io_buffer_size = %d\n", data->bout_bsiz);
-			}
+			data->bout_maxp = usb_endpoint_maxp(endpoint);
+			data->bout_bsiz = usbtmc_default_bsiz(data,
+						&iface_desc->endpoint[n],
+						&data->out_queue_depth);
 			dev_dbg(&intf->dev, "Found Bulk out endpoint at %u\n",
 				data->bulk_out);
 			break;
@@ -2674,6 +5972,10 @@ static int usbtmc_probe(struct usb_interface *intf,
 		}
 	}
 
+	retcode = usbtmc_alloc_buf_pool(data);
+	if (retcode)
+		goto error_register;
+
 	retcode = get_capabilities(data);
 	if (retcode)
 		dev_err(&intf->dev, "can't read capabilities\n");
@@ -2743,18 +6045,26 @@ static void usbtmc_disconnect(struct usb_interface *intf)
 
 	usb_deregister_dev(intf, &usbtmc_class);
 	mutex_lock(&data->io_mutex);
+	mutex_lock(&data->ctrl_mutex);
+	spin_lock_irq(&data->dev_lock);
 	data->zombie = 1;
+	spin_unlock_irq(&data->dev_lock);
+	mutex_unlock(&data->ctrl_mutex);
 	wake_up_interruptible_all(&data->waitq);
+	wake_up_all(&data->txn_wait);
 	list_for_each(elem, &data->file_list) {
 		struct usbtmc_file_data *file_data;
 
 		file_data = list_entry(elem,
 				       struct usbtmc_file_data,
 				       file_elem);
+		usbtmc_wake_poll(file_data, EPOLLHUP | EPOLLERR);
 		usb_kill_anchored_urbs(&file_data->submitted_in);
-		usb_scuttle_anchored_urbs(&file_data->in_anchor);
+		usbtmc_recover_in_urbs(file_data);
+		usbtmc_stream_stop(file_data);
 		usbtmc_recover_out_urbs(file_data);
 		usbtmc_release_out_urbs(file_data);
+		usbtmc_release_in_urbs(file_data);
 	}
 	mutex_unlock(&data->io_mutex);
 	usbtmc_free_int(data);
@@ -2769,10 +6079,11 @@ static void usbtmc_draw_down(struct usbtmc_file_data *file_data)
 	time = usb_wait_anchor_empty_timeout(&file_data->submitted_in, 1000);
 	if (!time)
 		usb_kill_anchored_urbs(&file_data->submitted_in);
-	usb_scuttle_anchored_urbs(&file_data->in_anchor);
+	usbtmc_recover_in_urbs(file_data);
 	time = usb_wait_anchor_empty_timeout(&file_data->submitted_out, 1000);
 	if (!time)
 		usbtmc_recover_out_urbs(file_data);
+	usb_kill_anchored_urbs(&file_data->submitted_zc);
 }
 
 static int usbtmc_suspend(struct usb_interface *intf, pm_message_t message)
@@ -2822,6 +6133,7 @@ static int usbtmc_pre_reset(struct usb_interface *intf)
 		return 0;
 
 	mutex_lock(&data->io_mutex);
+	mutex_lock(&data->ctrl_mutex);
 
 	list_for_each(elem, &data->file_list) {
 		struct usbtmc_file_data *file_data;
@@ -2839,6 +6151,7 @@ static int usbtmc_post_reset(struct usb_interface *intf)
 {
 	struct usbtmc_device_data *data  = usb_get_intfdata(intf);
 
+	mutex_unlock(&data->ctrl_mutex);
 	mutex_unlock(&data->io_mutex);
 
 	return 0;
@@ -2856,7 +6169,31 @@ static struct usb_driver usbtmc_driver = {
 	.dev_groups	= usbtmc_groups,
 };
 
-module_usb_driver(usbtmc_driver);
+static int __init usbtmc_init(void)
+{
+	int retval;
+
+	/* do not pin a reserve of multi-megabyte buffers */
+	usbtmc_buf_cache_size = clamp_t(unsigned int, io_buffer_size,
+					USBTMC_BUFSIZE, USBTMC_POOL_MAX_OBJ);
+	usbtmc_buf_cache = kmem_cache_create("usbtmc_buf",
+					     usbtmc_buf_cache_size, 0, 0, NULL);
+	if (!usbtmc_buf_cache)
+		return -ENOMEM;
+
+	retval = usb_register(&usbtmc_driver);
+	if (retval)
+		kmem_cache_destroy(usbtmc_buf_cache);
+	return retval;
+}
+module_init(usbtmc_init);
+
+static void __exit usbtmc_exit(void)
+{
+	usb_deregister(&usbtmc_driver);
+	kmem_cache_destroy(usbtmc_buf_cache);
+}
+module_exit(usbtmc_exit);
 
 MODULE_DESCRIPTION("USB Test & Measurement class driver");
 MODULE_LICENSE("GPL");